@@ -0,0 +1,999 @@
+// Benchmarks of the transparent marker library: the quad search, the
+// fused front end, the contour filter, pose refinement and the pyramid
+// detector, the stacked decoder, detection on synthetic scenes and under
+// synthetic lighting, batched decoding, the fixed-point path and the overlay compositor. each command prints a table to stdout.
+#include "transparent_markers.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+#include "opencv2/videoio/videoio.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+using namespace cv;
+using namespace std;
+using namespace transparent;
+static void help(const char* programName)
+{
+	cout <<
+		"\nTransparent marker benchmarks. Marker templates are read from\n"
+		"--markers, a directory or a compiled dictionary (default numbers).\n"
+		"Call:\n"
+		"./" << programName << " bench-squares <image>...\n"
+		"./" << programName << " [--markers dir] bench-pyramid <image>...\n"
+		"./" << programName << " bench-frontend [image]\n"
+		"./" << programName << " [--markers dir] bench-contours <image>...\n"
+		"./" << programName << " [--markers dir] bench-pose <video> [camera.yml]\n"
+		"./" << programName << " [--markers dir] bench-stacks [trials]\n"
+		"./" << programName << " [--markers dir] bench-synthetic [frames]\n"
+		"./" << programName << " [--markers dir] bench-decode [frames]\n"
+		"./" << programName << " [--markers dir] bench-lighting [frames]\n"
+		"./" << programName << " [--markers dir] bench-fixed [frames]\n"
+		"./" << programName << " bench-overlay [texture]\n"
+		"Using OpenCV version " << CV_VERSION << "\n" << endl;
+}
+// Canny threshold and number of threshold levels of findSquares
+static const int thresh = 50, N = 11;
+
+// the quad tests of findSquares and findSquaresFast: approx is the polygon
+// of contour, true when it is a large convex quad with ~90 degree corners
+static bool approxSquare(const vector<Point>& contour, vector<Point>& approx)
+{
+	// approximate contour with accuracy proportional
+	// to the contour perimeter
+	approxPolyDP(contour, approx, arcLength(contour, true) * 0.02, true);
+	// square contours should have 4 vertices after approximation
+	// relatively large area (to filter out noisy contours)
+	// and be convex.
+	// Note: absolute value of an area is used because
+	// area may be positive or negative - in accordance with the
+	// contour orientation
+	if (approx.size() != 4 ||
+		fabs(contourArea(approx)) <= 1000 ||
+		!isContourConvex(approx))
+		return false;
+	double maxCosine = 0;
+	for (int j = 2; j < 5; j++)
+	{
+		// find the maximum cosine of the angle between joint edges
+		double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
+		maxCosine = MAX(maxCosine, cosine);
+	}
+	// if cosines of all angles are small
+	// (all angles are ~90 degree) then it is a square
+	return maxCosine < 0.3;
+}
+// returns sequence of squares detected on the image.
+static void findSquares(const Mat& image, vector<vector<Point> >& squares)
+{
+	squares.clear();
+	Mat pyr, timg, gray0(image.size(), CV_8U), gray;
+	// down-scale and upscale the image to filter out the noise
+	pyrDown(image, pyr, Size(image.cols / 2, image.rows / 2));
+	pyrUp(pyr, timg, image.size());
+	vector<vector<Point> > contours;
+	// find squares in every color plane of the image
+	for (int c = 0; c < 3; c++)
+	{
+		int ch[] = { c, 0 };
+		mixChannels(&timg, 1, &gray0, 1, ch, 1);
+		// try several threshold levels
+		for (int l = 0; l < N; l++)
+		{
+			// hack: use Canny instead of zero threshold level.
+			// Canny helps to catch squares with gradient shading
+			if (l == 0)
+			{
+				// apply Canny. Take the upper threshold from slider
+				// and set the lower to 0 (which forces edges merging)
+				Canny(gray0, gray, 0, thresh, 5);
+				// dilate canny output to remove potential
+				// holes between edge segments
+				dilate(gray, gray, Mat(), Point(-1, -1));
+			}
+			else
+			{
+				// apply threshold if l!=0:
+				// tgray(x,y) = gray(x,y) < (l+1)*255/N ? 255 : 0
+				gray = gray0 >= (l + 1) * 255 / N;
+			}
+			// find contours and store them all as a list
+			findContours(gray, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
+			vector<Point> approx;
+			// test each contour
+			for (size_t i = 0; i < contours.size(); i++)
+			{
+				if (approxSquare(contours[i], approx))
+					squares.push_back(approx);
+			}
+		}
+	}
+}
+
+// single pass alternative to findSquares with the same output contract:
+// instead of Canny plus N global thresholds on every color plane, the
+// region hulls of the luminance (regionHulls, the contours of the
+// detector's FRONTEND_MSER) go through the same quad tests.
+static void findSquaresFast(const Mat& image, vector<vector<Point> >& squares)
+{
+	squares.clear();
+	Mat gray;
+	if (image.channels() == 3)
+		cvtColor(image, gray, COLOR_BGR2GRAY);
+	else
+		gray = image;
+	// kept between calls, as in the detector
+	static RegionHullScratch scratch;
+	static vector<vector<Point> > hulls;
+	int count = regionHulls(gray, 1000, hulls, scratch);
+	vector<Point> approx;
+	for (int i = 0; i < count; i++)
+	{
+		if (approxSquare(hulls[i], approx))
+			squares.push_back(approx);
+	}
+}
+
+// true when every corner of a has a corner of b closer than tolerance
+static bool sameQuad(const vector<Point>& a, const vector<Point>& b, double tolerance)
+{
+	for (size_t i = 0; i < a.size(); i++) {
+		bool found = false;
+		for (size_t j = 0; j < b.size() && !found; j++) {
+			Point d = a[i] - b[j];
+			found = d.x * d.x + d.y * d.y <= tolerance * tolerance;
+		}
+		if (!found) return false;
+	}
+	return true;
+}
+
+// compares findSquares against findSquaresFast on the same images.
+// recall is the fraction of findSquares quads that findSquaresFast also
+// reports (corners within 4 pixels).
+void benchmarkSquares(const vector<string>& files) {
+	double totalReference = 0, totalFast = 0;
+	size_t totalQuads = 0, totalFound = 0;
+	int frames = 0;
+	vector<vector<Point> > reference, fast;
+
+	printf("%-32s %8s %8s %8s %8s %7s\n", "image", "ref ms", "fast ms", "ref #", "fast #", "recall");
+	for (size_t f = 0; f < files.size(); f++) {
+		Mat image = imread(files[f], 1);
+		if (image.empty()) {
+			cerr << "could not read " << files[f] << endl;
+			continue;
+		}
+
+		int64 t0 = getTickCount();
+		findSquares(image, reference);
+		int64 t1 = getTickCount();
+		findSquaresFast(image, fast);
+		int64 t2 = getTickCount();
+
+		double referenceMs = (t1 - t0) * 1000.0 / getTickFrequency();
+		double fastMs = (t2 - t1) * 1000.0 / getTickFrequency();
+
+		size_t found = 0;
+		for (size_t i = 0; i < reference.size(); i++) {
+			for (size_t j = 0; j < fast.size(); j++) {
+				if (sameQuad(reference[i], fast[j], 4)) {
+					found++;
+					break;
+				}
+			}
+		}
+
+		printf("%-32s %8.2f %8.2f %8d %8d %6.1f%%\n", files[f].c_str(), referenceMs, fastMs,
+			(int)reference.size(), (int)fast.size(), reference.empty() ? 100.0 : 100.0 * found / reference.size());
+
+		totalReference += referenceMs;
+		totalFast += fastMs;
+		totalQuads += reference.size();
+		totalFound += found;
+		frames++;
+	}
+
+	if (frames == 0) return;
+	printf("mean ms/frame: findSquares %.2f, findSquaresFast %.2f (%.1fx), candidate recall %.1f%%\n",
+		totalReference / frames, totalFast / frames, totalReference / max(totalFast, 1e-9),
+		totalQuads == 0 ? 100.0 : 100.0 * totalFound / totalQuads);
+}
+
+// front-end microbenchmark at 360p, 720p and 1080p: the cvtColor +
+// threshold + Canny sequence against the fused kernel, scalar and SIMD.
+// also checks that the fused binary image matches threshold(cvtColor()).
+void benchmarkFrontEnd(const string& file) {
+	Mat source;
+	if (!file.empty()) source = imread(file, 1);
+	if (source.empty()) {
+		// synthetic input: noise with bright squares
+		source.create(1080, 1920, CV_8UC3);
+		randu(source, Scalar::all(0), Scalar::all(128));
+		for (int i = 0; i < 40; i++) {
+			rectangle(source, Rect((i * 193) % 1800, (i * 97) % 960, 60 + i, 60 + i), Scalar::all(200), FILLED);
+		}
+	}
+
+	const Size sizes[3] = { Size(640, 360), Size(1280, 720), Size(1920, 1080) };
+	const int ITERATIONS = 50;
+	bool simd = fusedKernelVectorized();
+
+	printf("%-10s %12s %12s %12s %10s\n", "size", "3-call ms", "fused ms", "fused simd", "bin diff");
+	for (int s = 0; s < 3; s++) {
+		Mat frame, gray, bin, edges, fusedBin, fusedEdges;
+		resize(source, frame, sizes[s]);
+
+		double ms[3] = { 0, 0, 0 };
+		for (int i = 0; i < ITERATIONS; i++) {
+			int64 t0 = getTickCount();
+			cvtColor(frame, gray, COLOR_BGR2GRAY);
+			threshold(gray, bin, 64, 255, THRESH_BINARY);
+			Canny(bin, edges, 0, thresh, 5);
+			int64 t1 = getTickCount();
+			binarizeAndEdges(frame, fusedBin, fusedEdges, false);
+			int64 t2 = getTickCount();
+			if (simd) binarizeAndEdges(frame, fusedBin, fusedEdges, true);
+			int64 t3 = getTickCount();
+			ms[0] += (t1 - t0) * 1000.0 / getTickFrequency();
+			ms[1] += (t2 - t1) * 1000.0 / getTickFrequency();
+			ms[2] += (t3 - t2) * 1000.0 / getTickFrequency();
+		}
+
+		Mat difference = bin != fusedBin;
+		printf("%4dx%-5d %12.3f %12.3f ", sizes[s].width, sizes[s].height, ms[0] / ITERATIONS, ms[1] / ITERATIONS);
+		if (simd) printf("%12.3f", ms[2] / ITERATIONS);
+		else printf("%12s", "n/a");
+		printf(" %10d\n", countNonZero(difference));
+	}
+}
+
+// contour stage before and after the hierarchy filter: time of
+// findCandidates and how many contours each early reject removed
+void benchmarkContours(const MarkerDictionary& dictionary, const vector<string>& files) {
+	MarkerDetector detector(dictionary);
+	double ms[2] = { 0, 0 };
+	CandidateStats totals[2];
+	int frames = 0;
+
+	for (size_t f = 0; f < files.size(); f++) {
+		Mat image = imread(files[f], 1);
+		if (image.empty()) {
+			cerr << "could not read " << files[f] << endl;
+			continue;
+		}
+		frames++;
+		detector.preprocess(image);
+
+		for (int mode = 0; mode < 2; mode++) {
+			detector.setHierarchyFilter(mode == 1);
+			int64 t0 = getTickCount();
+			detector.findCandidates();
+			ms[mode] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+
+			const CandidateStats& stats = detector.candidateStats();
+			totals[mode].contours += stats.contours;
+			totals[mode].holes += stats.holes;
+			totals[mode].open += stats.open;
+			totals[mode].small += stats.small;
+			totals[mode].approximated += stats.approximated;
+			totals[mode].candidates += stats.candidates;
+		}
+	}
+
+	if (frames == 0) return;
+	const char* names[2] = { "all contours", "hierarchy" };
+	printf("%-14s %9s %9s %9s %9s %9s %12s %11s\n", "filter", "ms/frame", "contours", "holes", "open", "small", "approximated", "candidates");
+	for (int mode = 0; mode < 2; mode++) {
+		printf("%-14s %9.3f %9.1f %9.1f %9.1f %9.1f %12.1f %11.1f\n", names[mode], ms[mode] / frames,
+			(double)totals[mode].contours / frames, (double)totals[mode].holes / frames, (double)totals[mode].open / frames,
+			(double)totals[mode].small / frames, (double)totals[mode].approximated / frames, (double)totals[mode].candidates / frames);
+	}
+}
+
+// second differences x[t-2] - 2 x[t-1] + x[t] of a few points per id over
+// consecutive frames: zero for a point at rest or moving at constant speed,
+// so what remains is mostly frame to frame noise
+struct JitterStats {
+	struct Track {
+		int frame = -2;
+		int count = 0;
+		double value[2][8];
+	};
+	vector<Track> tracks;
+	double sum = 0;
+	int samples = 0;
+
+	// value holds the points * dims coordinates of id in frame; only the
+	// first occurrence of an id in a frame is used
+	void add(int id, int frame, const double* value, int points, int dims) {
+		if (id >= (int)tracks.size()) tracks.resize(id + 1);
+		Track& track = tracks[id];
+		if (track.frame == frame) return;
+		if (track.frame != frame - 1) track.count = 0;
+		if (track.count >= 2) {
+			for (int p = 0; p < points; p++) {
+				for (int d = 0; d < dims; d++) {
+					int k = p * dims + d;
+					double v = track.value[0][k] - 2 * track.value[1][k] + value[k];
+					sum += v * v;
+				}
+				samples++;
+			}
+		}
+		memcpy(track.value[0], track.value[1], sizeof(track.value[0]));
+		memcpy(track.value[1], value, points * dims * sizeof(double));
+		track.frame = frame;
+		track.count++;
+	}
+
+	double rms() const { return samples ? sqrt(sum / samples) : 0; }
+};
+
+// refinement stage on a clip at 640x360: corner jitter (px RMS of the second
+// difference) of the integer corners against the subpixel ones, and the
+// cost per marker of findHomography with RANSAC against the four-point
+// solver, of the refinement and, with camera intrinsics, of solvePnP
+int benchmarkPose(const MarkerDictionary& dictionary, const string& video, const string& intrinsics) {
+	VideoCapture capture(video);
+	MarkerDetector detector(dictionary);
+	MarkerPoseEstimator refiner, estimator;
+	if (!intrinsics.empty() && !estimator.loadIntrinsics(intrinsics)) {
+		cerr << "could not read camera_matrix from " << intrinsics << endl;
+		return 1;
+	}
+
+	static const Point2f unitSquare[4] = { Point2f(0, 0), Point2f(1, 0), Point2f(1, 1), Point2f(0, 1) };
+	vector<Point2f> source(unitSquare, unitSquare + 4), destination(4);
+
+	Mat input, frame;
+	vector<DetectedMarker> markers;
+	vector<MarkerPose> refined, poses;
+	JitterStats integerJitter, subpixelJitter, translationJitter;
+	double ransacUs = 0, directUs = 0, refineUs = 0, poseUs = 0;
+	int frames = 0, total = 0;
+
+	while (capture.read(input)) {
+		resize(input, frame, Size(640, 360));
+		detector.detect(frame, markers);
+
+		int64 t0 = getTickCount();
+		for (size_t i = 0; i < markers.size(); i++) {
+			for (int c = 0; c < 4; c++) destination[c] = Point2f((float)markers[i].corners[c].x, (float)markers[i].corners[c].y);
+			findHomography(source, destination, RANSAC, 3);
+		}
+		int64 t1 = getTickCount();
+		for (size_t i = 0; i < markers.size(); i++) {
+			Point2f corners[4];
+			for (int c = 0; c < 4; c++) corners[c] = Point2f((float)markers[i].corners[c].x, (float)markers[i].corners[c].y);
+			Matx33d h;
+			quadHomography(unitSquare, corners, h);
+		}
+		int64 t2 = getTickCount();
+		refiner.estimate(frame, markers, refined);
+		int64 t3 = getTickCount();
+		if (estimator.hasIntrinsics()) estimator.estimate(frame, markers, poses);
+		int64 t4 = getTickCount();
+
+		ransacUs += (t1 - t0) * 1e6 / getTickFrequency();
+		directUs += (t2 - t1) * 1e6 / getTickFrequency();
+		refineUs += (t3 - t2) * 1e6 / getTickFrequency();
+		poseUs += (t4 - t3) * 1e6 / getTickFrequency();
+		total += (int)markers.size();
+
+		for (size_t i = 0; i < markers.size(); i++) {
+			double value[8];
+			for (int c = 0; c < 4; c++) {
+				value[2 * c] = markers[i].corners[c].x;
+				value[2 * c + 1] = markers[i].corners[c].y;
+			}
+			integerJitter.add(markers[i].id, frames, value, 4, 2);
+			for (int c = 0; c < 4; c++) {
+				value[2 * c] = refined[i].corners[c].x;
+				value[2 * c + 1] = refined[i].corners[c].y;
+			}
+			subpixelJitter.add(markers[i].id, frames, value, 4, 2);
+			if (estimator.hasIntrinsics() && poses[i].hasPose) {
+				translationJitter.add(markers[i].id, frames, poses[i].tvec.val, 1, 3);
+			}
+		}
+		frames++;
+	}
+
+	if (frames == 0) {
+		cerr << "could not read " << video << endl;
+		return 1;
+	}
+
+	int perMarker = max(total, 1);
+	printf("%d frames, %d markers\n", frames, total);
+	printf("homography us/marker: findHomography RANSAC %.1f, four-point %.1f\n", ransacUs / perMarker, directUs / perMarker);
+	printf("refinement us/marker: subpixel + four-point %.1f", refineUs / perMarker);
+	if (estimator.hasIntrinsics()) printf(", with solvePnP %.1f", poseUs / perMarker);
+	printf("\ncorner jitter px RMS: integer %.3f, subpixel %.3f\n", integerJitter.rms(), subpixelJitter.rms());
+	if (estimator.hasIntrinsics()) printf("translation jitter RMS: %.4f marker sides\n", translationJitter.rms());
+	return 0;
+}
+
+// length of the shortest side of the smallest marker in markers
+static double smallestMarkerSide(const vector<DetectedMarker>& markers) {
+	double smallest = 0;
+	for (size_t i = 0; i < markers.size(); i++) {
+		for (int c = 0; c < 4; c++) {
+			double side = norm(markers[i].corners[c] - markers[i].corners[(c + 1) % 4]);
+			if (smallest == 0 || side < smallest) smallest = side;
+		}
+	}
+	return smallest;
+}
+
+// high resolution benchmark: the demo path (resize to 640x360), full-frame
+// detection at native resolution, and the pyramid detector with 1 to 3
+// levels. reports ms per frame (coarse/refine split for the pyramid), the
+// number of markers found and the smallest marker side found in native
+// pixels, which is what bounds the detection range.
+void benchmarkPyramid(const MarkerDictionary& dictionary, const vector<string>& files) {
+	const int MODES = 5;
+	const char* modeNames[MODES] = { "resize 640x360", "native", "pyramid 1", "pyramid 2", "pyramid 3" };
+	double totalMs[MODES] = { 0 }, coarseMs[MODES] = { 0 }, refineMs[MODES] = { 0 }, smallest[MODES] = { 0 };
+	int totalMarkers[MODES] = { 0 };
+	int frames = 0;
+
+	MarkerDetector detector(dictionary);
+	vector<DetectedMarker> markers;
+	Mat small;
+	// built once: the timed loop measures detection, not construction
+	PyramidDetector pyramids[3] = { PyramidDetector(detector, 1), PyramidDetector(detector, 2), PyramidDetector(detector, 3) };
+
+	for (size_t f = 0; f < files.size(); f++) {
+		Mat image = imread(files[f], 1);
+		if (image.empty()) {
+			cerr << "could not read " << files[f] << endl;
+			continue;
+		}
+		frames++;
+
+		for (int mode = 0; mode < MODES; mode++) {
+			int64 t0 = getTickCount();
+			if (mode == 0) {
+				resize(image, small, Size(640, 360));
+				detector.detect(small, markers);
+				for (size_t i = 0; i < markers.size(); i++) {
+					for (int c = 0; c < 4; c++) {
+						markers[i].corners[c].x = markers[i].corners[c].x * image.cols / 640;
+						markers[i].corners[c].y = markers[i].corners[c].y * image.rows / 360;
+					}
+				}
+			}
+			else if (mode == 1) {
+				detector.detect(image, markers);
+			}
+			else {
+				PyramidDetector& pyramid = pyramids[mode - 2];
+				pyramid.detect(image, markers);
+				coarseMs[mode] += pyramid.coarseMilliseconds();
+				refineMs[mode] += pyramid.refineMilliseconds();
+			}
+			totalMs[mode] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+			totalMarkers[mode] += (int)markers.size();
+
+			double side = smallestMarkerSide(markers);
+			if (side > 0 && (smallest[mode] == 0 || side < smallest[mode])) smallest[mode] = side;
+		}
+	}
+
+	if (frames == 0) return;
+	printf("%-16s %10s %10s %10s %8s %14s\n", "mode", "ms/frame", "coarse ms", "refine ms", "markers", "smallest side");
+	for (int mode = 0; mode < MODES; mode++) {
+		printf("%-16s %10.2f %10.2f %10.2f %8d %12.1fpx\n", modeNames[mode], totalMs[mode] / frames,
+			coarseMs[mode] / frames, refineMs[mode] / frames, totalMarkers[mode], smallest[mode]);
+	}
+}
+
+// synthetic stacks of 1 to 4 distinct ids, each in a random rotation and
+// side. every layer of a transparent marker absorbs part of the light on
+// its black cells, so overlapping black cells get darker, and the cell
+// levels get gaussian noise. StackedDecoder is compared with the
+// reference that thresholds at half darkness and keeps every compatible
+// template: exact = the decoded ids are the stack, extra/missed = ids per
+// stack, conf = mean confidence of the right and of the wrong ids.
+void benchmarkStacks(const MarkerDictionary& dictionary, int trials) {
+	const int CELLS = MarkerDictionary::CELLS;
+	RNG rng(0x5eed);
+	StackedDecoder decoder(dictionary);
+	vector<MarkerMatch> matches;
+
+	printf("%-6s %-10s %8s %8s %8s %10s %8s %10s %10s\n", "depth", "decoder", "exact", "extra", "missed", "us/decode", "nodes", "conf ok", "conf bad");
+	for (int depth = 1; depth <= 4; depth++) {
+		if (depth > dictionary.size()) break;
+
+		double exact[2] = { 0 }, extra[2] = { 0 }, missed[2] = { 0 }, micros[2] = { 0 };
+		double nodes = 0, rightConfidence = 0, wrongConfidence = 0;
+		int right = 0, wrong = 0;
+		for (int t = 0; t < trials; t++) {
+			vector<int> ids;
+			while ((int)ids.size() < depth) {
+				int id = rng.uniform(0, dictionary.size());
+				if (find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+			}
+			sort(ids.begin(), ids.end());
+
+			float light[CELLS];
+			std::fill(light, light + CELLS, 1.f);
+			for (size_t k = 0; k < ids.size(); k++) {
+				uint32_t code = dictionary.code(ids[k], rng.uniform(0, 4), rng.uniform(0, 2));
+				float absorbed = (float)rng.uniform(0.7, 0.95);
+				for (int c = 0; c < CELLS; c++) {
+					if (code & (1u << c)) light[c] *= 1 - absorbed;
+				}
+			}
+			float darkness[CELLS];
+			uint32_t bright = 0;
+			for (int c = 0; c < CELLS; c++) {
+				darkness[c] = std::max(0.f, std::min(1.f, 1 - light[c] + (float)rng.gaussian(0.08)));
+				if (darkness[c] <= 0.5f) bright |= 1u << c;
+			}
+
+			for (int d = 0; d < 2; d++) {
+				int64 t0 = getTickCount();
+				if (d == 0) decoder.decode(darkness, matches);
+				else dictionary.retrieve(bright, matches);
+				micros[d] += (getTickCount() - t0) * 1e6 / getTickFrequency();
+
+				int found = 0;
+				for (size_t k = 0; k < matches.size(); k++) {
+					bool inStack = binary_search(ids.begin(), ids.end(), matches[k].id);
+					found += inStack;
+					if (d == 0 && inStack) {
+						rightConfidence += matches[k].confidence;
+						right++;
+					}
+					else if (d == 0) {
+						wrongConfidence += matches[k].confidence;
+						wrong++;
+					}
+				}
+				exact[d] += found == depth && (int)matches.size() == depth;
+				extra[d] += (int)matches.size() - found;
+				missed[d] += depth - found;
+			}
+			nodes += decoder.visitedNodes();
+		}
+
+		const char* names[2] = { "soft", "threshold" };
+		for (int d = 0; d < 2; d++) {
+			printf("%-6d %-10s %7.1f%% %8.2f %8.2f %10.2f ", depth, names[d], 100 * exact[d] / trials,
+				extra[d] / trials, missed[d] / trials, micros[d] / trials);
+			if (d == 0) {
+				printf("%8.1f %10.2f %10.2f\n", nodes / trials, right ? rightConfidence / right : 0., wrong ? wrongConfidence / wrong : 0.);
+			}
+			else printf("%8s %10s %10s\n", "-", "-", "-");
+		}
+	}
+}
+
+// overlay cost with 1 to 64 markers of 40 to 200 pixels on a 1280x720
+// frame: full-frame warps (the old sample code), ROI warps and ROI warps
+// from the texture pyramid. the ROI warp matches the full-frame one up to
+// the rounding of its fixed-point coordinates (max diff of a level or
+// two); the pyramid changes the sampling on purpose.
+void benchmarkOverlay(const string& textureFile) {
+	Mat texture = textureFile.empty() ? Mat() : imread(textureFile, 1);
+	if (texture.empty()) {
+		texture.create(512, 512, CV_8UC3);
+		randu(texture, Scalar::all(0), Scalar::all(255));
+	}
+
+	const int MODES = 3, REPEAT = 20;
+	const char* modeNames[MODES] = { "full frame", "roi", "roi + mipmaps" };
+	OverlayCompositor compositors[MODES];
+	int handles[MODES];
+	for (int mode = 0; mode < MODES; mode++) {
+		compositors[mode].setRoiOnly(mode > 0);
+		compositors[mode].setMipmaps(mode == 2);
+		handles[mode] = compositors[mode].addTexture(texture);
+	}
+
+	RNG rng(0x5eed);
+	Mat background(720, 1280, CV_8UC3), frames[MODES];
+	randu(background, Scalar::all(0), Scalar::all(255));
+	Point2f textureCorners[4] = { Point2f(0, 0), Point2f((float)texture.cols, 0), Point2f((float)texture.cols, (float)texture.rows), Point2f(0, (float)texture.rows) };
+
+	printf("%-8s %-14s %10s %14s %9s\n", "markers", "mode", "ms/frame", "pixels/frame", "max diff");
+	const int counts[4] = { 1, 8, 32, 64 };
+	for (int c = 0; c < 4; c++) {
+		vector<Matx33d> homographies;
+		while ((int)homographies.size() < counts[c]) {
+			float side = (float)rng.uniform(40., 200.);
+			Point2f center((float)rng.uniform(0., 1280.), (float)rng.uniform(0., 720.)), quad[4];
+			for (int k = 0; k < 4; k++) {
+				float x = (k == 1 || k == 2) ? side / 2 : -side / 2, y = k >= 2 ? side / 2 : -side / 2;
+				quad[k] = center + Point2f(x + (float)rng.uniform(-0.1, 0.1) * side, y + (float)rng.uniform(-0.1, 0.1) * side);
+			}
+			Matx33d h;
+			if (quadHomography(textureCorners, quad, h)) homographies.push_back(h);
+		}
+
+		for (int mode = 0; mode < MODES; mode++) {
+			double ms = 0;
+			compositors[mode].takeWarpedPixels();
+			for (int r = 0; r < REPEAT; r++) {
+				background.copyTo(frames[mode]);
+				int64 t0 = getTickCount();
+				for (size_t i = 0; i < homographies.size(); i++) compositors[mode].draw(frames[mode], handles[mode], homographies[i]);
+				ms += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+			}
+			double difference = norm(frames[mode], frames[0], NORM_INF);
+			printf("%-8d %-14s %10.3f %14.0f %9.0f\n", counts[c], modeNames[mode], ms / REPEAT,
+				(double)compositors[mode].takeWarpedPixels() / REPEAT, difference);
+		}
+	}
+}
+
+// detection quality of one configuration against the ground truth
+struct SceneScore {
+	int frames = 0;
+	int truth = 0, detections = 0;
+	int found = 0;       // truth markers detected with their id on their quad
+	int oriented = 0;    // ... and with the code of their rotation and side
+	double cornerError = 0;
+	double ms = 0;
+};
+
+// a detection matches a truth marker with the same id whose corners are
+// within a tenth of the marker side; each one matches at most once
+static void scoreScene(const MarkerDictionary& dictionary, const vector<SceneMarker>& truth, const vector<DetectedMarker>& markers, SceneScore& score) {
+	vector<bool> used(markers.size(), false);
+	score.truth += (int)truth.size();
+	score.detections += (int)markers.size();
+	for (size_t t = 0; t < truth.size(); t++) {
+		const SceneMarker& expected = truth[t];
+		double tolerance = 0.1 * norm(expected.corners[0] - expected.corners[1]);
+		int best = -1;
+		double bestError = tolerance;
+		for (size_t i = 0; i < markers.size(); i++) {
+			if (used[i] || markers[i].id != expected.id) continue;
+			double error = 0;
+			for (int c = 0; c < 4; c++) error += norm(Point2f(markers[i].corners[c]) - expected.corners[c]) / 4;
+			if (error < bestError) {
+				bestError = error;
+				best = (int)i;
+			}
+		}
+		if (best < 0) continue;
+		used[best] = true;
+		score.found++;
+		score.cornerError += bestError;
+		// symmetric templates look the same in several orientations
+		const DetectedMarker& m = markers[best];
+		score.oriented += dictionary.code(m.id, m.rotation, m.side) == dictionary.code(expected.id, expected.rotation, expected.side);
+	}
+}
+
+// recall, false positives, corner error and speed on generated scenes,
+// for three resolutions and 1, 4 and 16 markers per scene. single scenes
+// run the fixed-threshold detector, stacked scenes (up to 3 templates per
+// quad) the stacked one. marker sides scale with the frame height. false
+// positives are the detections that match no truth marker.
+void benchmarkSynthetic(const MarkerDictionary& dictionary, int frames) {
+	const Size sizes[3] = { Size(640, 360), Size(1280, 720), Size(1920, 1080) };
+	const int counts[3] = { 1, 4, 16 };
+
+	SceneGenerator generator(dictionary, 0x5eed);
+	vector<SceneMarker> truth;
+	vector<DetectedMarker> markers;
+	Mat frame;
+
+	printf("%-8s %-10s %6s %8s %8s %8s %10s %12s %8s\n", "scenes", "size", "count", "truth", "recall", "fp rate", "oriented", "corner err", "fps");
+	for (int stacked = 0; stacked < 2; stacked++) {
+		MarkerDetector detector(dictionary, stacked == 1);
+		for (int s = 0; s < 3; s++) {
+			for (int n = 0; n < 3; n++) {
+				SceneOptions options;
+				options.size = sizes[s];
+				options.markers = counts[n];
+				options.maxStack = stacked ? 3 : 1;
+				options.minSide = sizes[s].height / 8.0;
+				options.maxSide = sizes[s].height / 4.0;
+				// scale the minimum area with the smallest marker
+				detector.setMinArea(options.minSide * options.minSide / 4);
+
+				SceneScore score;
+				for (int f = 0; f < frames; f++) {
+					generator.generate(options, frame, truth);
+					int64 t0 = getTickCount();
+					detector.detect(frame, markers);
+					score.ms += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+					score.frames++;
+					scoreScene(dictionary, truth, markers, score);
+				}
+
+				printf("%-8s %4dx%-5d %6d %8d %7.1f%% %7.1f%% %9.1f%% %10.2fpx %8.1f\n", stacked ? "stacked" : "single",
+					options.size.width, options.size.height, options.markers, score.truth,
+					score.truth ? 100.0 * score.found / score.truth : 0.,
+					score.detections ? 100.0 * (score.detections - score.found) / score.detections : 0.,
+					score.found ? 100.0 * score.oriented / score.found : 0.,
+					score.found ? score.cornerError / score.found : 0., score.frames * 1000.0 / score.ms);
+			}
+		}
+	}
+}
+
+// fixed threshold (FRONTEND_FUSED) against FRONTEND_ADAPTIVE on 1280x720
+// synthetic scenes of 8 single markers under four lightings: the default
+// one, dim, near saturation and a strong gradient across the frame.
+// recall and false positives as in bench-synthetic, ms per detect().
+void benchmarkLighting(const MarkerDictionary& dictionary, int frames) {
+	struct Lighting {
+		const char* name;
+		double minLight, maxLight, gradient;
+	};
+	const Lighting lightings[4] = {
+		{ "normal", 170, 235, 0.3 }, { "dim", 35, 70, 0.3 }, { "bright", 240, 255, 0.3 }, { "gradient", 60, 235, 1.2 }
+	};
+	const FrontEnd frontEnds[2] = { FRONTEND_FUSED, FRONTEND_ADAPTIVE };
+	const char* frontEndNames[2] = { "fixed 64", "adaptive" };
+
+	vector<SceneMarker> truth;
+	vector<DetectedMarker> markers;
+	Mat frame;
+
+	printf("%-10s %-10s %8s %8s %8s %10s\n", "lighting", "front end", "truth", "recall", "fp rate", "ms/frame");
+	for (int l = 0; l < 4; l++) {
+		SceneOptions options;
+		options.size = Size(1280, 720);
+		options.markers = 8;
+		options.minSide = options.size.height / 8.0;
+		options.maxSide = options.size.height / 4.0;
+		options.minLight = lightings[l].minLight;
+		options.maxLight = lightings[l].maxLight;
+		options.lightingGradient = lightings[l].gradient;
+
+		for (int f = 0; f < 2; f++) {
+			// the same scenes for both front ends
+			SceneGenerator generator(dictionary, 0x1165 + l);
+			MarkerDetector detector(dictionary);
+			detector.setFrontEnd(frontEnds[f]);
+			detector.setMinArea(options.minSide * options.minSide / 4);
+
+			SceneScore score;
+			for (int n = 0; n < frames; n++) {
+				generator.generate(options, frame, truth);
+				int64 t0 = getTickCount();
+				detector.detect(frame, markers);
+				score.ms += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+				score.frames++;
+				scoreScene(dictionary, truth, markers, score);
+			}
+
+			printf("%-10s %-10s %8d %7.1f%% %7.1f%% %10.3f\n", lightings[l].name, frontEndNames[f], score.truth,
+				score.truth ? 100.0 * score.found / score.truth : 0.,
+				score.detections ? 100.0 * (score.detections - score.found) / score.detections : 0., score.ms / score.frames);
+		}
+	}
+}
+
+// decode stage on cluttered synthetic 1280x720 scenes (16 to 64 markers of
+// 40 to 80 pixels): decodeCandidates with the batched decoder against the
+// per-candidate one, for the fixed, stacked (hard) and soft stacked
+// decoders. differing = frames whose markers are not the same; the batch
+// maps round differently from the 8x8 solve, so a rare sample can land
+// 1/32 pixel away.
+void benchmarkDecode(const MarkerDictionary& dictionary, int frames) {
+	const int counts[3] = { 16, 32, 64 };
+	const char* decoderNames[3] = { "fixed", "stacked", "soft" };
+
+	SceneGenerator generator(dictionary, 0xdec0de);
+	vector<SceneMarker> truth;
+	vector<DetectedMarker> single, batched;
+	Mat frame;
+
+	printf("%-8s %6s %10s %14s %12s %8s %10s\n", "decoder", "count", "quads", "single ms", "batch ms", "speedup", "differing");
+	for (int d = 0; d < 3; d++) {
+		MarkerDetector detector(dictionary, d > 0);
+		detector.setSoftStacking(d == 2);
+		detector.setMinArea(400);
+		for (int n = 0; n < 3; n++) {
+			SceneOptions options;
+			options.size = Size(1280, 720);
+			options.markers = counts[n];
+			options.maxStack = d ? 3 : 1;
+			options.minSide = 40;
+			options.maxSide = 80;
+
+			double ms[2] = { 0, 0 };
+			int quads = 0, differing = 0;
+			for (int f = 0; f < frames; f++) {
+				generator.generate(options, frame, truth);
+				detector.preprocess(frame);
+				detector.findCandidates();
+				quads += (int)detector.quads().size();
+
+				for (int batch = 0; batch < 2; batch++) {
+					detector.setBatchDecoding(batch == 1);
+					int64 t0 = getTickCount();
+					detector.decodeCandidates(batch ? batched : single);
+					ms[batch] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+				}
+
+				bool same = single.size() == batched.size();
+				for (size_t i = 0; same && i < single.size(); i++) {
+					same = single[i].id == batched[i].id && single[i].rotation == batched[i].rotation && single[i].side == batched[i].side;
+				}
+				differing += !same;
+			}
+
+			printf("%-8s %6d %10.1f %14.3f %12.3f %7.2fx %10d\n", decoderNames[d], counts[n], (double)quads / frames,
+				ms[0] / frames, ms[1] / frames, ms[0] / max(ms[1], 1e-9), differing);
+		}
+	}
+}
+
+// fixed-point path against the double one on synthetic scenes: the same
+// preprocessed frame goes through findCandidates and the batched
+// decodeCandidates with each Math. ms per frame for the contour filter and
+// the decode stage; quad diff = frames whose candidates differ, marker
+// diff = frames whose markers differ when both decode the same candidates.
+void benchmarkFixed(const MarkerDictionary& dictionary, int frames) {
+	struct Config {
+		const char* name;
+		Size size;
+		bool stacked;
+	};
+	const Config configs[4] = {
+		{ "single", Size(640, 360), false },
+		{ "single", Size(1280, 720), false },
+		{ "stacked", Size(640, 360), true },
+		{ "stacked", Size(1280, 720), true },
+	};
+
+	SceneGenerator generator(dictionary, 0xf1ced);
+	vector<SceneMarker> truth;
+	vector<MarkerQuad> quads;
+	vector<DetectedMarker> markers[2];
+	Mat frame;
+
+	printf("%-8s %10s %11s %11s %10s %11s %11s %11s\n", "scene", "size", "filter ms", "fixed ms", "quad diff",
+		"decode ms", "fixed ms", "marker diff");
+	for (int c = 0; c < 4; c++) {
+		const Config& config = configs[c];
+		MarkerDetector detector(dictionary, config.stacked);
+		detector.setBatchDecoding(true);
+		SceneOptions options;
+		options.size = config.size;
+		options.markers = 8;
+		options.maxStack = config.stacked ? 3 : 1;
+		options.minSide = config.size.height / 8;
+		options.maxSide = config.size.height / 3;
+
+		double filterMs[2] = { 0, 0 }, decodeMs[2] = { 0, 0 };
+		int quadDiff = 0, markerDiff = 0;
+		for (int f = 0; f < frames; f++) {
+			generator.generate(options, frame, truth);
+			detector.preprocess(frame);
+
+			int64 t0 = getTickCount();
+			detector.findCandidates<DoubleMath>();
+			filterMs[0] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+			quads = detector.quads();
+			t0 = getTickCount();
+			detector.findCandidates<FixedMath>();
+			filterMs[1] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+
+			bool same = quads.size() == detector.quads().size();
+			for (size_t i = 0; same && i < quads.size(); i++) {
+				same = std::equal(quads[i].corners, quads[i].corners + 4, detector.quads()[i].corners);
+			}
+			quadDiff += !same;
+
+			for (int fixed = 0; fixed < 2; fixed++) {
+				t0 = getTickCount();
+				if (fixed) detector.decodeCandidates<FixedMath>(markers[1]);
+				else detector.decodeCandidates<DoubleMath>(markers[0]);
+				decodeMs[fixed] += (getTickCount() - t0) * 1000.0 / getTickFrequency();
+			}
+
+			same = markers[0].size() == markers[1].size();
+			for (size_t i = 0; same && i < markers[0].size(); i++) {
+				same = markers[0][i].id == markers[1][i].id && markers[0][i].rotation == markers[1][i].rotation &&
+					markers[0][i].side == markers[1][i].side;
+			}
+			markerDiff += !same;
+		}
+
+		printf("%-8s %5dx%-4d %11.3f %11.3f %10d %11.3f %11.3f %11d\n", config.name, config.size.width, config.size.height,
+			filterMs[0] / frames, filterMs[1] / frames, quadDiff, decodeMs[0] / frames, decodeMs[1] / frames, markerDiff);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	string markers = "numbers";
+	int first = 1;
+	if (argc > 2 && string(argv[1]) == "--markers") {
+		markers = argv[2];
+		first = 3;
+	}
+	// the option is dropped, so argv[1] is the command below
+	argv[first - 1] = argv[0];
+	argv += first - 1;
+	argc -= first - 1;
+
+	// bench-squares img1 img2 ...: compares findSquares and findSquaresFast
+	if (argc > 2 && string(argv[1]) == "bench-squares") {
+		benchmarkSquares(vector<string>(argv + 2, argv + argc));
+		return 0;
+	}
+
+	// bench-frontend [image]: fused SIMD front end against cvtColor + threshold + Canny
+	if (argc > 1 && string(argv[1]) == "bench-frontend") {
+		benchmarkFrontEnd(argc > 2 ? argv[2] : "");
+		return 0;
+	}
+
+	// bench-overlay [texture]: ROI compositing against full-frame warps
+	if (argc > 1 && string(argv[1]) == "bench-overlay") {
+		benchmarkOverlay(argc > 2 ? argv[2] : "");
+		return 0;
+	}
+
+	MarkerDictionary dictionary;
+	if (!dictionary.load(markers)) {
+		cerr << "could not load marker templates from " << markers << endl;
+		return 1;
+	}
+
+	// bench-pyramid img1 img2 ...: coarse-to-fine detection on high resolution images
+	if (argc > 2 && string(argv[1]) == "bench-pyramid") {
+		benchmarkPyramid(dictionary, vector<string>(argv + 2, argv + argc));
+		return 0;
+	}
+
+	// bench-contours img1 img2 ...: contour stage with and without the hierarchy filter
+	if (argc > 2 && string(argv[1]) == "bench-contours") {
+		benchmarkContours(dictionary, vector<string>(argv + 2, argv + argc));
+		return 0;
+	}
+
+	// bench-pose clip.avi [camera.yml]: corner jitter and cost of the refinement stage
+	if (argc > 2 && string(argv[1]) == "bench-pose") {
+		return benchmarkPose(dictionary, argv[2], argc > 3 ? argv[3] : "");
+	}
+
+	// bench-synthetic [frames]: recall and speed on generated scenes with ground truth
+	if (argc > 1 && string(argv[1]) == "bench-synthetic") {
+		benchmarkSynthetic(dictionary, argc > 2 ? max(1, atoi(argv[2])) : 20);
+		return 0;
+	}
+
+	// bench-lighting [frames]: fixed against adaptive threshold under synthetic lighting
+	if (argc > 1 && string(argv[1]) == "bench-lighting") {
+		benchmarkLighting(dictionary, argc > 2 ? max(1, atoi(argv[2])) : 20);
+		return 0;
+	}
+
+	// bench-decode [frames]: batched against per-candidate decoding on cluttered scenes
+	if (argc > 1 && string(argv[1]) == "bench-decode") {
+		benchmarkDecode(dictionary, argc > 2 ? max(1, atoi(argv[2])) : 50);
+		return 0;
+	}
+
+	// bench-fixed [frames]: fixed-point against double detection on generated scenes
+	if (argc > 1 && string(argv[1]) == "bench-fixed") {
+		benchmarkFixed(dictionary, argc > 2 ? max(1, atoi(argv[2])) : 50);
+		return 0;
+	}
+
+	// bench-stacks [trials]: stacked decoder on synthetic stacks of 1 to 4 markers
+	if (argc > 1 && string(argv[1]) == "bench-stacks") {
+		benchmarkStacks(dictionary, argc > 2 ? max(1, atoi(argv[2])) : 2000);
+		return 0;
+	}
+
+	help(argv[0]);
+	return 1;
+}
@@ -1,783 +1,1650 @@
-// The "Square Detector" program.
-// It loads several images sequentially and tries to find squares in
-// each image
-#include "opencv2/features2d/features2d.hpp"
+// Transparent marker samples: the front/back (boy/girl) and color
+// applications on a camera or clip, a headless batch runner and the
+// self tests of the detector library.
+#include "transparent_markers.hpp"
+
 #include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+#include "opencv2/videoio/videoio.hpp"
 #include "opencv2/highgui/highgui.hpp"
-#include "opencv2/calib3d/calib3d.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <thread>
 using namespace cv;
 using namespace std;
+using namespace transparent;
 static void help(const char* programName)
 {
 	cout <<
-		"\nA program using pyramid scaling, Canny, contours and contour simplification\n"
-		"to find squares in a list of images (pic1-6.png)\n"
-		"Returns sequence of squares detected on the image.\n"
+		"\nTransparent marker samples. Without a command runs the front/back\n"
+		"sample application on camera 0 (--color: the color sample on 4e5.avi).\n"
+		"Marker templates are read from --markers, a directory of template\n"
+		"images or a compiled dictionary (default <assets>/numbers; the\n"
+		"samples tell the faces apart by the images in <assets>/numbers),\n"
+		"images and clips from --assets (default .), and the composited frames\n"
+		"are recorded to --output (default output.avi; .mp4, or .mjpg for an\n"
+		"appendable motion-JPEG stream; \"\" to disable). --trace writes\n"
+		"the stage timings as Chrome trace events (needs a TM_TRACE build).\n"
 		"Call:\n"
-		"./" << programName << " [file_name (optional)]\n"
+		"./" << programName << " [--markers dir] [--assets dir] [--output file] [--color] [--trace file]\n"
+		"./" << programName << " [--markers dir] batch <video|directory> [--csv] [--output file] [--stacked] [--adaptive|--mser] [--threads n] [--size WxH] [--track n]\n"
+		"      [--votes k] [--refine] [--intrinsics camera.yml] [--marker-size s]\n"
+		"./" << programName << " [--markers dir] compile-dictionary <file>\n"
+		"./" << programName << " [--markers dir] generate-scenes <directory> [count] [--size WxH] [--count n] [--stack n] [--seed s]\n"
+		"./" << programName << " [--markers dir] serve <camera|video>[@budget] ... [--threads n] [--budget ms] [--stacked] [--seconds s] [--interval s]\n"
+		"./" << programName << " [--markers dir] test-sampling <video>\n"
+		"./" << programName << " [--markers dir] test-allocations [video]\n"
+		"./" << programName << " [--markers dir] test-voting\n"
+		"Benchmarks are in transparent_benchmark.\n"
 		"Using OpenCV version " << CV_VERSION << "\n" << endl;
 }
-int thresh = 50, N = 11;
-const char* wndname = "Square Detection Demo";
-// helper function:
-// finds a cosine of angle between vectors
-// from pt0->pt1 and from pt0->pt2
-static double angle(Point pt1, Point pt2, Point pt0)
-{
-	double dx1 = pt1.x - pt0.x;
-	double dy1 = pt1.y - pt0.y;
-	double dx2 = pt2.x - pt0.x;
-	double dy2 = pt2.y - pt0.y;
-	return (dx1 * dx2 + dy1 * dy2) / sqrt((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2) + 1e-10);
+void printMarkerNames(const MarkerDictionary& dictionary, const vector<int>& indexes) {
+	for (size_t i = 0; i < indexes.size(); i++) {
+		cout << dictionary.name(indexes[i]) << endl;
+	}
 }
-// returns sequence of squares detected on the image.
-static void findSquares(const Mat& image, vector<vector<Point> >& squares)
-{
-	squares.clear();
-	Mat pyr, timg, gray0(image.size(), CV_8U), gray;
-	// down-scale and upscale the image to filter out the noise
-	pyrDown(image, pyr, Size(image.cols / 2, image.rows / 2));
-	pyrUp(pyr, timg, image.size());
-	vector<vector<Point> > contours;
-	// find squares in every color plane of the image
-	for (int c = 0; c < 3; c++)
-	{
-		int ch[] = { c, 0 };
-		mixChannels(&timg, 1, &gray0, 1, ch, 1);
-		// try several threshold levels
-		for (int l = 0; l < N; l++)
-		{
-			// hack: use Canny instead of zero threshold level.
-			// Canny helps to catch squares with gradient shading
-			if (l == 0)
-			{
-				// apply Canny. Take the upper threshold from slider
-				// and set the lower to 0 (which forces edges merging)
-				Canny(gray0, gray, 0, thresh, 5);
-				// dilate canny output to remove potential
-				// holes between edge segments
-				dilate(gray, gray, Mat(), Point(-1, -1));
-			}
-			else
-			{
-				// apply threshold if l!=0:
-				// tgray(x,y) = gray(x,y) < (l+1)*255/N ? 255 : 0
-				gray = gray0 >= (l + 1) * 255 / N;
-			}
-			// find contours and store them all as a list
-			findContours(gray, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
-			vector<Point> approx;
-			// test each contour
-			for (size_t i = 0; i < contours.size(); i++)
-			{
-				// approximate contour with accuracy proportional
-				// to the contour perimeter
-				approxPolyDP(contours[i], approx, arcLength(contours[i], true) * 0.02, true);
-				// square contours should have 4 vertices after approximation
-				// relatively large area (to filter out noisy contours)
-				// and be convex.
-				// Note: absolute value of an area is used because
-				// area may be positive or negative - in accordance with the
-				// contour orientation
-				if (approx.size() == 4 &&
-					fabs(contourArea(approx)) > 1000 &&
-					isContourConvex(approx))
-				{
-					double maxCosine = 0;
-					for (int j = 2; j < 5; j++)
-					{
-						// find the maximum cosine of the angle between joint edges
-						double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-						maxCosine = MAX(maxCosine, cosine);
-					}
-					// if cosines of all angles are small
-					// (all angles are ~90 degree) then write quandrange
-					// vertices to resultant sequence
-					if (maxCosine < 0.3)
-						squares.push_back(approx);
-				}
+
+void test(const string& assets) {
+	Mat lady = imread(assets + "/lady.jpg", 1);
+	
+	Mat lady2 = lady.clone();
+
+	for (int i = 0; i < lady2.rows; i++) {
+		for (int j = 0; j < lady2.cols; j++) {
+			Vec3b pixel = lady2.at<Vec3b>(i, j);
+			int average = (pixel.val[0] + pixel.val[1] + pixel.val[2]) / 3;
+			int limit = 20;
+			if (abs(average - pixel.val[0]) > limit || abs(average - pixel.val[1]) > limit || abs(average - pixel.val[2]) > limit) {
+				lady2.at<Vec3b>(i, j) = Vec3b(0, 0, 255);
 			}
 		}
 	}
+	
+	imshow("lady", lady);
+	imshow("lady2", lady2);
+	waitKey(0);
 }
 
-vector<vector<Point>> markerTemplates;
+// bounded lock-free queue between two pipeline stages: one producer thread,
+// one consumer thread. push and pop wait (spin, then sleep) while the queue
+// is full or empty.
+template<typename T>
+class SpscQueue {
+public:
+	explicit SpscQueue(size_t capacity) : items(capacity + 1), head(0), tail(0) {}
+
+	bool tryPush(const T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t next = (t + 1) % items.size();
+		if (next == head.load(std::memory_order_acquire)) return false;
+		items[t] = item;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
 
-void loadMarkerTemplates() {
+	bool tryPop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		item = items[h];
+		head.store((h + 1) % items.size(), std::memory_order_release);
+		return true;
+	}
 
-	std::string path = "numbers/";
-	for (const auto& entry : std::filesystem::directory_iterator(path)) {
-		//std::cout << entry.path() << std::endl;
+	void push(const T& item) {
+		for (int spins = 0; !tryPush(item); spins++) backoff(spins);
+	}
 
-		Mat image = imread(entry.path().string(), 0);
-		vector<Point> blackPoints;
-		for (int i = 0; i < image.rows; i++) {
-			for (int j = 0; j < image.cols; j++) {
-				if (image.at<unsigned char>(i, j) == 0) blackPoints.push_back(Point(j, i));
-			}
-		}
-		markerTemplates.push_back(blackPoints);
+	T pop() {
+		T item;
+		for (int spins = 0; !tryPop(item); spins++) backoff(spins);
+		return item;
 	}
 
-}
+	size_t size() const {
+		size_t h = head.load(std::memory_order_acquire), t = tail.load(std::memory_order_acquire);
+		return (t + items.size() - h) % items.size();
+	}
 
-vector<int> retrieveMarkers(int markerMatrix[11][11]) {
-	vector<int> result;
-	for (int i = 0; i < markerTemplates.size(); i++) {
-		bool ok = true;
-		for (int j = 0; j < markerTemplates[i].size(); j++) {
-			if (markerMatrix[markerTemplates[i][j].y + 3][markerTemplates[i][j].x + 3] == 1) {
-				ok = false;
-				break;
-			}
+private:
+	static void backoff(int spins) {
+		if (spins < 64) std::this_thread::yield();
+		else std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	vector<T> items;
+	std::atomic<size_t> head, tail;
+};
+
+// what FrameRecorder::write does when every slot is queued or encoding:
+// drop the new frame, drop the oldest queued frame for it, or wait
+enum DropPolicy { DROP_NEWEST, DROP_OLDEST, DROP_NONE };
+
+// records frames on a background thread. write() copies the frame into
+// one of a fixed number of slots allocated by open() and returns; the
+// encoder thread takes the slots in order and writes them to a video file
+// (VideoWriter, MJPG in .avi, mp4v in .mp4) or, for .mjpg, appends them as
+// JPEG images to a single motion-JPEG stream. memory stays at the slot
+// count, and a full ring drops frames by the policy instead of stalling
+// the caller (except with DROP_NONE).
+class FrameRecorder {
+public:
+	explicit FrameRecorder(int slots = 8, DropPolicy policy = DROP_NEWEST) : slots(max(slots, 1)), policy(policy) {}
+	~FrameRecorder() { close(); }
+
+	// frames of another size are resized to size
+	bool open(const string& path, double fps, Size size, int type = CV_8UC3) {
+		close();
+		this->size = size;
+		string extension = std::filesystem::path(path).extension().string();
+		if (extension == ".mjpg") {
+			stream = fopen(path.c_str(), "ab");
+			if (!stream) return false;
 		}
-		if (ok) {
-			result.push_back(i);
+		else {
+			int fourcc = extension == ".mp4" ? VideoWriter::fourcc('m', 'p', '4', 'v') : VideoWriter::fourcc('M', 'J', 'P', 'G');
+			if (!writer.open(path, fourcc, fps, size, type == CV_8UC3)) return false;
 		}
+
+		frames.resize(slots);
+		for (int i = 0; i < slots; i++) frames[i].create(size, type);
+		freeSlots.clear();
+		for (int i = 0; i < slots; i++) freeSlots.push_back(i);
+		ready.assign(slots, 0);
+		readyHead = readyCount = 0;
+		dropped = written = 0;
+		stopping = false;
+		encoder = std::thread([this] { encodeLoop(); });
+		return true;
 	}
-	return result;
-}
 
-void printMarkerNames(vector<int> indexes) {
-	std::string path = "numbers/";
-	int i = 0;
-	vector<string> names;
+	bool isOpen() const { return encoder.joinable(); }
 
-	for (const auto& entry : std::filesystem::directory_iterator(path)) {
-		//std::cout << entry.path() << std::endl;
-		names.push_back(entry.path().string());
-	}
+	// false when the frame was dropped
+	bool write(const Mat& frame) {
+		if (!isOpen()) return false;
+		int slot;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			if (freeSlots.empty() && policy == DROP_NONE) slotFreed.wait(guard, [this] { return !freeSlots.empty(); });
+			if (!freeSlots.empty()) {
+				slot = freeSlots.back();
+				freeSlots.pop_back();
+			}
+			else if (policy == DROP_OLDEST && readyCount > 0) {
+				slot = popReady();
+				dropped++;
+			}
+			else {
+				dropped++;
+				return false;
+			}
+		}
 
-	for (int i = 0; i < indexes.size(); i++) {
-		cout << names[indexes[i]] << endl;
+		// the slot is neither free nor queued: copy without the lock
+		if (frame.size() == size) frame.copyTo(frames[slot]);
+		else resize(frame, frames[slot], size);
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ready[(readyHead + readyCount++) % slots] = slot;
+		}
+		frameReady.notify_one();
+		return true;
 	}
-}
 
-vector<int> processMarker(Mat image, vector<Point> contour) {
-	Mat content;
-	content.create(242, 242, CV_8UC1);
-	Mat content2;
+	// writes what is queued and closes the file
+	void close() {
+		if (!isOpen()) return;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		frameReady.notify_one();
+		encoder.join();
+		writer.release();
+		if (stream) fclose(stream);
+		stream = 0;
+	}
 
-	vector<Point2f> objectPoints;
-	//objectPoints.push_back(Point(0, 0));
-	objectPoints.push_back(Point(44, 44));
-	//objectPoints.push_back(Point(241, 0));
-	objectPoints.push_back(Point(241 - 44, 44));
-	//objectPoints.push_back(Point(241, 241));
-	objectPoints.push_back(Point(241 - 44, 241 - 44));
-	//objectPoints.push_back(Point(0, 241));
-	objectPoints.push_back(Point(44, 241 - 44));
+	int64 droppedFrames() const {
+		std::lock_guard<std::mutex> guard(lock);
+		return dropped;
+	}
 
-	Mat h;
+	int64 writtenFrames() const {
+		std::lock_guard<std::mutex> guard(lock);
+		return written;
+	}
 
-	//cout << h << endl;
+private:
+	// oldest queued slot; the lock is held
+	int popReady() {
+		int slot = ready[readyHead];
+		readyHead = (readyHead + 1) % slots;
+		readyCount--;
+		return slot;
+	}
 
-	//cout << endl;
-	//cout << endl;
+	void encodeLoop() {
+		while (true) {
+			int slot;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				frameReady.wait(guard, [this] { return stopping || readyCount > 0; });
+				if (readyCount == 0) return;
+				slot = popReady();
+			}
 
-	h = findHomography(contour, objectPoints, RANSAC, 3);
+			if (stream) {
+				imencode(".jpg", frames[slot], encoded);
+				fwrite(encoded.data(), 1, encoded.size(), stream);
+			}
+			else writer.write(frames[slot]);
 
-	//cout << h << endl;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				freeSlots.push_back(slot);
+				written++;
+			}
+			slotFreed.notify_one();
+		}
+	}
 
-	warpPerspective(image, content, h, Size(242, 242));
+	int slots;
+	DropPolicy policy;
+	Size size;
+	VideoWriter writer;
+	FILE* stream = 0;
+	vector<uchar> encoded;
+	vector<Mat> frames;
+
+	mutable std::mutex lock;
+	std::condition_variable frameReady, slotFreed;
+	vector<int> freeSlots;
+	vector<int> ready; // ring of queued slots, oldest first
+	int readyHead = 0, readyCount = 0;
+	int64 dropped = 0, written = 0;
+	bool stopping = false;
+	std::thread encoder;
+};
+
+// one frame travelling through the pipeline. packets are preallocated and
+// recycled, so their images keep their buffers from frame to frame.
+struct FramePacket {
+	Mat input, frame, bin, edges, full;
+	vector<DetectedMarker> markers;
+	int64 captured;
+	bool last;
+};
+
+typedef std::function<void(FramePacket&)> CompositeFunction;
+
+// runs capture -> detect -> composite -> output with each stage on its own
+// thread (output, which owns the window, on the calling thread) and bounded
+// queues in between. composite draws packet.full from the packet's frame,
+// binary image, edges and markers. every 100 frames it prints the
+// capture-to-shown latency and the share of time each stage was busy;
+// the busiest stage is the bottleneck. ESC stops the pipeline. the frames
+// are recorded to recording (see FrameRecorder) unless it is empty; the
+// recorder drops frames rather than holding the output stage back. with a
+// profiler on the detector, compositing is timed as STAGE_OVERLAY, a frame
+// ends when it is shown and the rolling stage times are printed with the
+// report.
+void runPipeline(VideoCapture& capture, MarkerDetector& detector, const CompositeFunction& composite, const char* windowName,
+	const string& recording) {
+	const int PACKETS = 4;
+	enum { CAPTURE, DETECT, COMPOSITE, OUTPUT, STAGES };
+	const char* stageNames[STAGES] = { "capture", "detect", "composite", "output" };
+
+	vector<FramePacket> packets(PACKETS);
+	SpscQueue<FramePacket*> freePackets(PACKETS), captured(PACKETS), detected(PACKETS), composited(PACKETS);
+	for (int p = 0; p < PACKETS; p++) freePackets.push(&packets[p]);
+
+	Profiler* profiler = detector.getProfiler();
+	FrameRecorder recorder;
+	if (!recording.empty() && !recorder.open(recording, 30, Size(1280, 720))) {
+		cerr << "could not record to " << recording << endl;
+	}
+	std::atomic<bool> stop(false);
+	std::atomic<int64> busy[STAGES];
+	for (int s = 0; s < STAGES; s++) busy[s] = 0;
+
+	std::thread captureThread([&] {
+		while (true) {
+			FramePacket* packet = freePackets.pop();
+			int64 start = getTickCount();
+			// ler o frame da camera
+			packet->last = stop.load() || !capture.read(packet->input);
+			if (!packet->last) resize(packet->input, packet->frame, Size(640, 360));
+			packet->captured = getTickCount();
+			busy[CAPTURE] += packet->captured - start;
+			captured.push(packet);
+			if (packet->last) return;
+		}
+	});
+
+	std::thread detectThread([&] {
+		while (true) {
+			FramePacket* packet = captured.pop();
+			if (!packet->last) {
+				int64 start = getTickCount();
+				// processar o marcador
+				detector.detect(packet->frame, packet->markers);
+				detector.binary().copyTo(packet->bin);
+				detector.edges().copyTo(packet->edges);
+				busy[DETECT] += getTickCount() - start;
+			}
+			detected.push(packet);
+			if (packet->last) return;
+		}
+	});
+
+	std::thread compositeThread([&] {
+		while (true) {
+			FramePacket* packet = detected.pop();
+			if (!packet->last) {
+				int64 start = getTickCount();
+				packet->full.create(720, 1280, CV_8UC3);
+				TM_SCOPE(profiler, STAGE_OVERLAY);
+				composite(*packet);
+				busy[COMPOSITE] += getTickCount() - start;
+			}
+			composited.push(packet);
+			if (packet->last) return;
+		}
+	});
 
-	threshold(content, content, 128, 255, THRESH_OTSU);
+	int counter = 0;
+	int64 reportStart = getTickCount();
+	int64 reportBusy[STAGES] = { 0 };
+	double latencySum = 0, latencyMax = 0;
 
-	cvtColor(content, content2, COLOR_GRAY2RGB);
+	while (true) {
+		FramePacket* packet = composited.pop();
+		if (packet->last) break;
 
-	int markerMatrix[11][11];
+		int64 start = getTickCount();
 
-	for (int i = 0; i < 11; i++) {
-		for (int j = 0; j < 11; j++) {
-			//circle(content2, Point(11 + 22 * j, 11 + 22 * i), 3, Scalar(0, 0, 255), -1);
-			markerMatrix[i][j] = content.at<unsigned char>(11 + 22 * i, 11 + 22 * j)/255;
-			//printf("%d ", markerMatrix[i][j]);
+		//exibe o resultado final
+		imshow(windowName, packet->full);
+		if (waitKey(1) == 27) stop = true;
+
+		recorder.write(packet->full);
+		counter++;
+		if (profiler) profiler->endFrame();
+
+		int64 end = getTickCount();
+		busy[OUTPUT] += end - start;
+
+		double latency = (end - packet->captured) * 1000.0 / getTickFrequency();
+		latencySum += latency;
+		latencyMax = max(latencyMax, latency);
+		freePackets.push(packet);
+
+		if (counter % 100 == 0) {
+			double elapsed = (double)(end - reportStart);
+			printf("%d frames, %.1f fps, latency avg %.1f ms max %.1f ms, %d dropped by the recorder, busy:", counter,
+				100 * getTickFrequency() / elapsed, latencySum / 100, latencyMax, (int)recorder.droppedFrames());
+			for (int s = 0; s < STAGES; s++) {
+				int64 total = busy[s].load();
+				printf(" %s %.0f%%", stageNames[s], 100.0 * (total - reportBusy[s]) / elapsed);
+				reportBusy[s] = total;
+			}
+			printf("\n");
+			if (profiler) profiler->printSnapshot(stdout);
+			reportStart = end;
+			latencySum = latencyMax = 0;
 		}
-		//printf("\n");
 	}
-	//printf("\n");
 
-	bool isValid = true;
-	/*for (int i = 0; i < 11 && isValid; i++) {
-		for (int j = 0; j < 11 && isValid; j++) {
-			if (i == 0 || i == 1 || i == 9 || i == 10 || j == 0 || j == 1 || j == 9 || j == 10) {
-				if (markerMatrix[i][j] == 1) isValid = false;
+	captureThread.join();
+	detectThread.join();
+	compositeThread.join();
+	if (recorder.isOpen()) {
+		recorder.close();
+		printf("%d frames recorded to %s, %d dropped\n", (int)recorder.writtenFrames(), recording.c_str(), (int)recorder.droppedFrames());
+	}
+}
+
+// the template images of the samples, in file name order: four
+// orientations per face, boy front, boy back, girl front, girl back (the
+// color sample: eight of marker 4, then marker 5). a decoded variant is
+// traced back to the image it matches, so the face and the overlay
+// orientation do not depend on how the dictionary folded the images.
+class TemplateImages {
+public:
+	bool load(const MarkerDictionary& dictionary, const string& directory) {
+		vector<string> files;
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+			if (entry.is_regular_file()) files.push_back(entry.path().filename().string());
+		}
+		if (error) return false;
+		// the order of the dictionary ids
+		std::sort(files.begin(), files.end());
+		images.assign((size_t)dictionary.size() * MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS, -1);
+		int index = 0;
+		for (size_t f = 0; f < files.size(); f++) {
+			uint32_t code;
+			if (!MarkerDictionary::readTemplate(directory + "/" + files[f], code)) continue;
+			for (size_t v = 0; v < images.size(); v++) {
+				int id = (int)(v / (MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS));
+				int side = (int)(v / MarkerDictionary::ROTATIONS % MarkerDictionary::SIDES), rotation = (int)(v % MarkerDictionary::ROTATIONS);
+				if (images[v] < 0 && dictionary.code(id, rotation, side) == code) images[v] = index;
 			}
+			index++;
 		}
-	}*/
+		return index > 0;
+	}
 
-	for (int i = 2; i < 9; i++) {
-		if (markerMatrix[i][2] == 0) isValid = false;
-		if (markerMatrix[i][8] == 0) isValid = false;
-		if (markerMatrix[2][i] == 0) isValid = false;
-		if (markerMatrix[8][i] == 0) isValid = false;
+	// index of the image marker was decoded as, -1 if it matches none
+	int image(const DetectedMarker& marker) const {
+		size_t v = ((size_t)marker.id * MarkerDictionary::SIDES + marker.side) * MarkerDictionary::ROTATIONS + marker.rotation;
+		return v < images.size() ? images[v] : -1;
 	}
 
-	//printf("is valid: %d\n", isValid);
+private:
+	vector<int> images; // [id][side][rotation]
+};
 
-	if (!isValid) return vector<int>();
+// overlay corners of the boy/girl sample for template image index, from
+// the template-ordered corners of a pose: the fronts turn with the marker,
+// the backs are drawn as seen, unrotated and unmirrored
+void overlayCorners(const Point2f corners[4], const DetectedMarker& marker, int image, Point2f result[4]) {
+	static const int shift[4] = { 0, 2, 3, 1 };
 
-	vector<int> markers = retrieveMarkers(markerMatrix);
+	// image order, undoing templateCorners
+	Point2f seen[4];
+	for (int k = 0; k < 4; k++) seen[((marker.side ? k ^ 1 : k) + marker.rotation) % 4] = corners[k];
 
-	//printMarkerNames(markers);
+	int s = (image % 8) < 4 ? shift[image % 4] : 0;
+	for (int i = 0; i < 4; i++) result[i] = seen[(i + s) % 4];
+}
 
-	//cout << "numero de marcadores encontrados com sucesso: " << markers.size() << endl;
+void boygirl_application(const MarkerDictionary& dictionary, const TemplateImages& images, const string& assets, const string& output, Profiler* profiler) {
 
-	//imshow("content", content2);
-	//waitKey(0);
-	
-	//return 0;
+	// carregar as imagens do menino e da menina
+	Mat boy_front = imread(assets + "/boy_front.jpg");
+	Mat boy_back = imread(assets + "/boy_back.jpg");
+	Mat girl_front = imread(assets + "/girl_front.jpg");
+	Mat girl_back = imread(assets + "/girl_back.jpg");
 
-	return markers;
-}
+	// inciar a camera
+	VideoCapture capture;
+	capture.open(0);
+	//capture.open(assets + "/1e2.avi");
+
+	MarkerDetector detector(dictionary);
+	detector.setThreads(0);
+	detector.setProfiler(profiler);
+	// a misdecoded frame no longer flips boy and girl, and still markers are not decoded again
+	detector.setTemporalVoting(5);
+
+	// subpixel corners keep the overlay from swimming; with camera.yml the
+	// marker poses are estimated too
+	MarkerPoseEstimator estimator;
+	estimator.loadIntrinsics(assets + "/camera.yml");
+	estimator.setProfiler(profiler);
+	vector<MarkerPose> poses;
+
+	Point2f objectPoints[4];
+	objectPoints[0] = Point2f(0, 0);
+	objectPoints[1] = Point2f(boy_front.cols, 0);
+	objectPoints[2] = Point2f(boy_front.cols, boy_front.rows);
+	objectPoints[3] = Point2f(0, boy_front.rows);
+
+	// only the box under each marker is warped
+	OverlayCompositor overlays;
+	int boyFront = overlays.addTexture(boy_front), boyBack = overlays.addTexture(boy_back);
+	int girlFront = overlays.addTexture(girl_front), girlBack = overlays.addTexture(girl_back);
+
+	CompositeFunction composite = [&](FramePacket& packet) {
+		Mat& frame = packet.frame;
+
+		Mat full1 = packet.full(Rect(0, 0, 640, 360));
+		Mat full2 = packet.full(Rect(640, 0, 640, 360));
+		Mat full3 = packet.full(Rect(0, 360, 640, 360));
+		Mat full4 = packet.full(Rect(640, 360, 640, 360));
 
-void test() {
-	Mat lady = imread("lady.jpg", 1);
-	
-	Mat lady2 = lady.clone();
+		frame.copyTo(full1);
+		cvtColor(packet.bin, full2, COLOR_GRAY2BGR);
+		cvtColor(packet.edges, full3, COLOR_GRAY2BGR);
 
-	for (int i = 0; i < lady2.rows; i++) {
-		for (int j = 0; j < lady2.cols; j++) {
-			Vec3b pixel = lady2.at<Vec3b>(i, j);
-			int average = (pixel.val[0] + pixel.val[1] + pixel.val[2]) / 3;
-			int limit = 20;
-			if (abs(average - pixel.val[0]) > limit || abs(average - pixel.val[1]) > limit || abs(average - pixel.val[2]) > limit) {
-				lady2.at<Vec3b>(i, j) = Vec3b(0, 0, 255);
+		estimator.estimate(frame, packet.markers, poses);
+
+		for (size_t i = 0; i < poses.size(); i++) {
+			int m = poses[i].id;
+			if (poses[i].hasPose) {
+				printf("Marker ID: %d t = (%.3f, %.3f, %.3f)\n", m, poses[i].tvec[0], poses[i].tvec[1], poses[i].tvec[2]);
 			}
+			else printf("Marker ID: %d\n", m);
+
+			int image = images.image(packet.markers[i]);
+			if (image < 0) continue;
+			Point2f imagePoints[4];
+			overlayCorners(poses[i].corners, packet.markers[i], image, imagePoints);
+
+			Matx33d h;
+			if (!quadHomography(objectPoints, imagePoints, h)) continue;
+
+			const int faces[4] = { boyFront, boyBack, girlFront, girlBack };
+			int mini = faces[std::min(image / 4, 3)];
+
+			// aplicar um warp especifico na imagem de saida
+			overlays.draw(frame, mini, h);
 		}
-	}
-	
-	imshow("lady", lady);
-	imshow("lady2", lady2);
-	waitKey(0);
+		frame.copyTo(full4);
+	};
+
+	runPipeline(capture, detector, composite, "Front/Back sample application", output);
 }
 
-int processMarker2(Mat image, vector<Point> contour) {
-	Mat content;
-	content.create(242, 242, CV_8UC1);
-	Mat content2;
+void color_application(const MarkerDictionary& dictionary, const TemplateImages& images, const string& assets, const string& output, Profiler* profiler) {
 
-	vector<Point2f> objectPoints;
-	//objectPoints.push_back(Point(0, 0));
-	objectPoints.push_back(Point(44, 44));
-	//objectPoints.push_back(Point(241, 0));
-	objectPoints.push_back(Point(241-44, 44));
-	//objectPoints.push_back(Point(241, 241));
-	objectPoints.push_back(Point(241-44, 241-44));
-	//objectPoints.push_back(Point(0, 241));
-	objectPoints.push_back(Point(44, 241-44));
+	// carregar as imagens do menino e da menina
 
-	Mat h;
+	Mat marker4 = imread(assets + "/marker4_.jpg", 1);
+	Mat marker5 = imread(assets + "/marker5_.jpg");
+
+	Mat yellow;
+	yellow.create(11, 11, CV_8UC3);
+	Mat blue = yellow.clone();
+	Mat green = yellow.clone();
+
+	yellow = Scalar(0,255,255);
+	blue = Scalar(255,0,0);
+	green = Scalar(0,128,0);
 
-	//cout << h << endl;
+	// inciar a camera
+	VideoCapture capture;
+	//capture.open(0);
+	capture.open(assets + "/4e5.avi");
 
-	//cout << endl;
-	//cout << endl;
+	MarkerDetector detector(dictionary, true);
+	detector.setProfiler(profiler);
+	detector.setThreads(0);
 
-	h = findHomography(contour, objectPoints, RANSAC, 3);
+	Point2f objectPoints[4];
+	objectPoints[0] = Point2f(0, 0);
+	objectPoints[1] = Point2f(9, 0);
+	objectPoints[2] = Point2f(9, 9);
+	objectPoints[3] = Point2f(0, 9);
 
-	//cout << h << endl;
+	Point2f objectPoints2[4];
+	objectPoints2[0] = Point2f(20, 20);
+	objectPoints2[1] = Point2f(90, 20);
+	objectPoints2[2] = Point2f(90, 90);
+	objectPoints2[3] = Point2f(20, 90);
 
-	warpPerspective(image, content, h, Size(242, 242));
+	OverlayCompositor overlays;
+	int yellowTexture = overlays.addTexture(yellow), blueTexture = overlays.addTexture(blue), greenTexture = overlays.addTexture(green);
+	int marker4Texture = overlays.addTexture(marker4), marker5Texture = overlays.addTexture(marker5);
 
-	//threshold(content, content, 32, 255, THRESH_BINARY);
+	CompositeFunction composite = [&](FramePacket& packet) {
+		Mat& frame = packet.frame;
+		packet.full = 0;
 
-	//cvtColor(content, content2, COLOR_GRAY2RGB);
+		Mat full1 = packet.full(Rect(0, 0, 640, 360));
+		Mat full2 = packet.full(Rect(640, 0, 640, 360));
+		Mat full3 = packet.full(Rect(0, 360, 640, 360));
+		Mat full4 = packet.full(Rect(640, 360, 640, 360));
 
-	
+		frame.copyTo(full1);
 
-	int markerMatrix[11][11];
+		for (size_t k = 0; k < packet.markers.size(); k++) {
+			const DetectedMarker& marker = packet.markers[k];
+			printf("Marker ID: %d (%d stacked, confidence %.2f)\n", marker.id, marker.stacked, marker.confidence);
 
-	for (int i = 0; i < 11; i++) {
-		for (int j = 0; j < 11; j++) {
-			circle(content2, Point(11 + 22 * j, 11 + 22 * i), 1, Scalar(0, 0, 255), -1);
-			markerMatrix[i][j] = (content.at<unsigned char>(11 + 22 * i, 11 + 22 * j) > 64) ? 1 : 0;
-			//printf("%d ", markerMatrix[i][j]);
-		}
-		//printf("\n");
-	}
-	//printf("\n");
+			Point2f imagePoints[4];
+			for (int j = 0; j < 4; j++) imagePoints[j] = marker.corners[j];
 
-	//imshow("debug", content2);
-	//waitKey(1);
+			Matx33d h, h2;
+			if (!quadHomography(objectPoints, imagePoints, h) ||
+				!quadHomography(objectPoints2, imagePoints, h2)) continue;
 
-	/*for (int i = 0; i < 5; i++) {
-		for (int j = 0; j < 5; j++) {
-			printf("%c",(markerMatrix[i+3][j+3]==0)?' ':'X');
-		}
-		printf("\n");
-	}*/
+			int image = images.image(marker);
+			if (image < 0) continue;
+			if (image / 8 == 0) {
+				overlays.draw(frame, yellowTexture, h);
+				overlays.draw(full2, marker4Texture, h2);
+			}
+			else {
+				overlays.draw(frame, blueTexture, h);
+				overlays.draw(full3, marker5Texture, h2);
+			}
 
-	bool isValid = true;
-	/*for (int i = 0; i < 11 && isValid; i++) {
-		for (int j = 0; j < 11 && isValid; j++) {
-			if (i == 0 || i == 1 || i == 9 || i == 10 || j == 0 || j == 1 || j == 9 || j == 10) {
-				if (markerMatrix[i][j] == 1) isValid = false;
+			if (marker.stacked == 2) {
+				overlays.draw(frame, greenTexture, h);
 			}
 		}
-	}*/
-
-	for (int i = 2; i < 9; i++) {
-		if (markerMatrix[i][2] == 0) isValid = false;
-		if (markerMatrix[i][8] == 0) isValid = false;
-		if (markerMatrix[2][i] == 0) isValid = false;
-		if (markerMatrix[8][i] == 0) isValid = false;
-	}
+		frame.copyTo(full4);
+	};
 
-	//printf(">>>>> %d\n", isValid);
+	runPipeline(capture, detector, composite, "Color sample application", output);
+}
 
-	//printf("is valid: %d\n", isValid);
+#ifdef TM_COUNT_ALLOCATIONS
+// heap allocation counter for test-allocations. malloc and friends are
+// interposed so that allocations made inside OpenCV (cv::fastMalloc) are
+// counted as well as operator new. the ones made inside the OpenCV calls
+// the library marks with TM_OPENCV_CALL are counted apart.
+static std::atomic<size_t> allocationCount(0), openCvAllocationCount(0);
 
-	if (!isValid) return -1;
-	imshow("content", content);
-	
-	//else return 0;
-	
-	vector<int> markers = retrieveMarkers(markerMatrix);
-	if (markers.size() > 0) return markers[0];
+static void countAllocation() {
+	if (transparent::openCvCallDepth > 0) openCvAllocationCount.fetch_add(1, std::memory_order_relaxed);
+	else allocationCount.fetch_add(1, std::memory_order_relaxed);
+}
 
-	//printMarkerNames(markers);
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
 
-	//cout << "numero de marcadores encontrados com sucesso: " << markers.size() << endl;
+void* malloc(size_t size) {
+	countAllocation();
+	return __libc_malloc(size);
+}
 
-	//imshow("content", content2);
-	//waitKey(0);
+void* calloc(size_t count, size_t size) {
+	countAllocation();
+	return __libc_calloc(count, size);
+}
 
-	return -1;
+void* realloc(void* ptr, size_t size) {
+	countAllocation();
+	return __libc_realloc(ptr, size);
 }
 
-vector<Point> orderContour(vector<Point> contour) {
+void* memalign(size_t alignment, size_t size) {
+	countAllocation();
+	return __libc_memalign(alignment, size);
+}
 
-	vector<Point> result;
-	
-	float xcenter = (contour[0].x + contour[1].x + contour[2].x + contour[3].x) / 4;
-	float ycenter = (contour[0].y + contour[1].y + contour[2].y + contour[3].y) / 4;
+void* aligned_alloc(size_t alignment, size_t size) {
+	return memalign(alignment, size);
+}
 
-	for (int i = 0; i < 4; i++) {
-		if (contour[i].x < xcenter && contour[i].y < ycenter) {
-			result.push_back(contour[i]);
-			break;
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+	*ptr = memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+}
+#endif
+
+// loads 8 random 5x5 templates (0 = black cell), written as NN.png to a
+// temporary directory, for the self tests without marker assets
+static bool loadRandomTemplates(MarkerDictionary& dictionary) {
+	string directory = (std::filesystem::temp_directory_path() / "transparent_test_templates").string();
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	RNG rng(1);
+	char filename[32];
+	for (int id = 0; id < 8; id++) {
+		Mat cells(MarkerDictionary::GRID, MarkerDictionary::GRID, CV_8UC1);
+		for (int i = 0; i < MarkerDictionary::GRID; i++) {
+			for (int j = 0; j < MarkerDictionary::GRID; j++) cells.at<unsigned char>(i, j) = rng.uniform(0, 2) ? 0 : 255;
 		}
+		snprintf(filename, sizeof(filename), "/%02d.png", id);
+		if (!imwrite(directory + filename, cells)) return false;
 	}
+	if (!dictionary.load(directory)) return false;
+	printf("random templates in %s\n", directory.c_str());
+	return true;
+}
 
-	for (int i = 0; i < 4; i++) {
-		if (contour[i].x > xcenter && contour[i].y < ycenter) {
-			result.push_back(contour[i]);
-			break;
-		}
+// runs every detect() of several detector configurations (front ends,
+// stacked decoding, per-candidate decoding, threads, temporal voting,
+// PyramidDetector) over a clip and counts its heap allocations per frame
+// after a warm-up. without a clip the frames are generated by
+// SceneGenerator, from the templates of markers or, when they do not load,
+// from random ones. allocations inside the OpenCV calls with internal work
+// buffers (TM_OPENCV_CALL) are reported apart; any other allocation fails
+// the test. OpenCV's own threads are turned off: its parallel_for_
+// allocates per call. build with TRANSPARENT_COUNT_ALLOCATIONS (glibc).
+int testAllocations(const string& markers, const string& video) {
+#ifndef TM_COUNT_ALLOCATIONS
+	(void)markers;
+	(void)video;
+	cerr << "test-allocations needs a build with -DTM_COUNT_ALLOCATIONS" << endl;
+	return 1;
+#else
+	MarkerDictionary dictionary;
+	if (!dictionary.load(markers) && (!video.empty() || !loadRandomTemplates(dictionary))) {
+		cerr << "could not load marker templates from " << markers << endl;
+		return 1;
 	}
 
-	for (int i = 0; i < 4; i++) {
-		if (contour[i].x > xcenter && contour[i].y > ycenter) {
-			result.push_back(contour[i]);
-			break;
+	vector<Mat> frames;
+	if (!video.empty()) {
+		VideoCapture capture(video);
+		Mat input;
+		while (capture.read(input)) {
+			Mat frame;
+			resize(input, frame, Size(640, 360));
+			frames.push_back(frame);
+		}
+		if (frames.empty()) {
+			cerr << "could not read " << video << endl;
+			return 1;
 		}
 	}
-
-	for (int i = 0; i < 4; i++) {
-		if (contour[i].x < xcenter && contour[i].y > ycenter) {
-			result.push_back(contour[i]);
-			break;
+	else {
+		SceneGenerator generator(dictionary, 1);
+		SceneOptions options;
+		options.markers = 8;
+		options.maxStack = 2;
+		vector<SceneMarker> truth;
+		for (int n = 0; n < 30; n++) {
+			Mat frame;
+			generator.generate(options, frame, truth);
+			frames.push_back(frame);
 		}
 	}
+	setNumThreads(0);
+
+	struct Configuration {
+		const char* name;
+		bool stacked;
+		FrontEnd frontEnd;
+		bool batch;
+		int threads, votes, levels;
+	};
+	const Configuration configurations[] = {
+		{ "fused", false, FRONTEND_FUSED, true, 1, 0, 0 },
+		{ "canny", false, FRONTEND_CANNY, true, 1, 0, 0 },
+		{ "adaptive", false, FRONTEND_ADAPTIVE, true, 1, 0, 0 },
+		{ "mser", false, FRONTEND_MSER, true, 1, 0, 0 },
+		{ "stacked", true, FRONTEND_FUSED, true, 1, 0, 0 },
+		{ "per-candidate decoding", false, FRONTEND_FUSED, false, 1, 0, 0 },
+		{ "4 threads", false, FRONTEND_FUSED, true, 4, 0, 0 },
+		{ "temporal voting", false, FRONTEND_FUSED, true, 1, 5, 0 },
+		{ "pyramid", false, FRONTEND_FUSED, true, 1, 0, 1 },
+		{ "pyramid, adaptive", false, FRONTEND_ADAPTIVE, true, 1, 0, 1 },
+	};
+
+	bool passed = true;
+	vector<DetectedMarker> found;
+	for (const Configuration& configuration : configurations) {
+		MarkerDetector detector(dictionary, configuration.stacked);
+		detector.setFrontEnd(configuration.frontEnd);
+		detector.setBatchDecoding(configuration.batch);
+		detector.setThreads(configuration.threads);
+		detector.setTemporalVoting(configuration.votes);
+		std::unique_ptr<PyramidDetector> pyramid;
+		if (configuration.levels > 0) pyramid.reset(new PyramidDetector(detector, configuration.levels));
+		auto detect = [&](const Mat& frame) {
+			if (pyramid) pyramid->detect(frame, found);
+			else detector.detect(frame, found);
+		};
+
+		// warm-up: let every buffer reach its steady-state capacity
+		for (int pass = 0; pass < 2; pass++) {
+			for (size_t i = 0; i < frames.size(); i++) detect(frames[i]);
+		}
 
-	return result;
+		size_t libraryTotal = 0, openCvTotal = 0;
+		for (size_t i = 0; i < frames.size(); i++) {
+			size_t a0 = allocationCount.load(), o0 = openCvAllocationCount.load();
+			detect(frames[i]);
+			size_t a1 = allocationCount.load(), o1 = openCvAllocationCount.load();
+			libraryTotal += a1 - a0;
+			openCvTotal += o1 - o0;
+			if (a1 > a0) printf("%s, frame %d: %d allocations\n", configuration.name, (int)i, (int)(a1 - a0));
+		}
+		printf("%s: allocations per frame after warm-up %.2f, in OpenCV calls %.2f\n", configuration.name,
+			(double)libraryTotal / frames.size(), (double)openCvTotal / frames.size());
+		passed = passed && libraryTotal == 0;
+	}
+	printf("%s\n", passed ? "PASSED" : "FAILED");
+	return passed ? 0 : 1;
+#endif
 }
 
-vector<Point> orderContour2(vector<Point> contour, int offset) {
-
-	vector<Point> result;
-
-	switch (offset%8) {
-		case 0:
-			result.push_back(contour[0]);
-			result.push_back(contour[1]);
-			result.push_back(contour[2]);
-			result.push_back(contour[3]);
-			break;
-		case 1:
-			result.push_back(contour[2]);
-			result.push_back(contour[3]);
-			result.push_back(contour[0]);
-			result.push_back(contour[1]);
-			break;
-		case 2:
-			result.push_back(contour[3]);
-			result.push_back(contour[0]);
-			result.push_back(contour[1]);
-			result.push_back(contour[2]);
-			break;
-		case 3:
-			result.push_back(contour[1]);
-			result.push_back(contour[2]);
-			result.push_back(contour[3]);
-			result.push_back(contour[0]);
-			break;
-
-		default:
-			result.push_back(contour[0]);
-			result.push_back(contour[1]);
-			result.push_back(contour[2]);
-			result.push_back(contour[3]);
-			break;
-	}
-
-	return result;
+// draws the marker of code, unrotated, in the middle of a plain frame
+static void drawTestMarker(uint32_t code, Mat& frame) {
+	const int GRID = MarkerDictionary::GRID, CELL = 20, ORIGIN = 50;
+	frame.create(320, 320, CV_8UC3);
+	frame.setTo(Scalar::all(200));
+	for (int i = 0; i < 11; i++) {
+		for (int j = 0; j < 11; j++) {
+			bool black = i < 2 || i > 8 || j < 2 || j > 8;
+			if (i >= 3 && i < 3 + GRID && j >= 3 && j < 3 + GRID) black = (code >> ((i - 3) * GRID + j - 3)) & 1;
+			if (black) rectangle(frame, Rect(ORIGIN + j * CELL, ORIGIN + i * CELL, CELL, CELL), Scalar::all(0), FILLED);
+		}
+	}
 }
 
-void boygirl_application() {
-
-	// carregar as imagens do menino e da menina
-	Mat boy_front = imread("boy_front.jpg");
-	Mat boy_back = imread("boy_back.jpg");
-	Mat girl_front = imread("girl_front.jpg");
-	Mat girl_back = imread("girl_back.jpg");
-
-	// inciar a camera
-	VideoCapture capture;
-	capture.open(0);
-	//capture.open("1e2.avi");
-
-	Mat frame, bin, gray, bin2, gray2;
-	vector<vector<Point> > contours;
-
-	Mat full;
-	full.create(720, 1280, CV_8UC3);
-
-	Mat full1 = full(Rect(0, 0, 640, 360));
-	Mat full2 = full(Rect(640, 0, 640, 360));
-	Mat full3 = full(Rect(0, 360, 640, 360));
-	Mat full4 = full(Rect(640, 360, 640, 360));
-	
-	int counter = 0;
-
-	// criar o loop principal da aplicacao
-	while (true) {
-		// ler o frame da camera
-		capture.read(frame);
-		resize(frame, frame, Size(640, 360));
-
-		frame.copyTo(full1);
-
-		cvtColor(frame, gray, COLOR_BGR2GRAY);
-
-		// processar o marcador
-		threshold(gray, bin, 64, 255, THRESH_BINARY);
-		cvtColor(bin, bin2, COLOR_GRAY2BGR);
-		bin2.copyTo(full2);
-
-		Canny(bin, gray, 0, thresh, 5);
-		cvtColor(gray, gray2, COLOR_GRAY2BGR);
-		gray2.copyTo(full3);
-
-		//imshow("bin", bin);
-		//imshow("gray", gray);
-
-		findContours(gray, contours, RETR_CCOMP, CHAIN_APPROX_SIMPLE);
+// temporal voting on a still quad whose template changes from a to b. after
+// a full window of a, b is reported on its votes / 2 + 1-th frame
+// (ceil(votes / 2), votes being odd) and not before, so fewer misdecoded
+// frames are held back; after a single frame of a, no later. without
+// templates in markers random ones are used.
+int testVoting(const string& markers) {
+	MarkerDictionary dictionary;
+	if (!dictionary.load(markers) && !loadRandomTemplates(dictionary)) {
+		cerr << "could not load marker templates" << endl;
+		return 1;
+	}
 
-		vector<Point> approx;
+	Mat frame;
+	vector<DetectedMarker> found;
+	// the id reported for the frame of id (-1: none or several)
+	auto reported = [&](MarkerDetector& detector, int id) {
+		drawTestMarker(dictionary.code(id), frame);
+		detector.detect(frame, found);
+		return found.size() == 1 ? found[0].id : -1;
+	};
+
+	// two templates that decode alone and whose black cell counts differ by
+	// 3, so the bright pixels of the quad change by more than the decode
+	// cache of a still quad tolerates (3%)
+	MarkerDetector plain(dictionary);
+	vector<int> alone;
+	for (int i = 0; i < dictionary.size(); i++) {
+		if (reported(plain, i) == i) alone.push_back(i);
+	}
+	int a = -1, b = -1;
+	for (size_t i = 0; i < alone.size() && b < 0; i++) {
+		for (size_t k = 0; k < alone.size() && b < 0; k++) {
+			int cellsA = (int)std::bitset<32>(dictionary.code(alone[i])).count();
+			int cellsB = (int)std::bitset<32>(dictionary.code(alone[k])).count();
+			if (abs(cellsA - cellsB) >= 3) {
+				a = alone[i];
+				b = alone[k];
+			}
+		}
+	}
+	if (b < 0) {
+		cerr << "no two templates of " << markers << " to switch between" << endl;
+		return 1;
+	}
 
-		//printf("%d\n", contours.size());
+	bool passed = true;
+	for (int votes = 3; votes <= 7; votes += 2) {
+		for (int history = 1; history <= votes; history += votes - 1) {
+			MarkerDetector detector(dictionary);
+			detector.setTemporalVoting(votes);
+			bool seen = true;
+			for (int k = 0; k < history; k++) seen = seen && reported(detector, a) == a;
+
+			int frames = 1;
+			while (frames <= votes && reported(detector, b) != b) frames++;
+			bool ok = seen && (history == votes ? frames == votes / 2 + 1 : frames <= votes / 2 + 1);
+			printf("votes %d, %d frames of id %d: id %d reported after %d frames%s\n", votes, history, a, b, frames, ok ? "" : " FAILED");
+			passed = passed && ok;
+		}
+	}
+	printf("%s\n", passed ? "PASSED" : "FAILED");
+	return passed ? 0 : 1;
+}
 
-		for (size_t i = 0; i < contours.size(); i++)
-		{
-			approxPolyDP(contours[i], approx, arcLength(contours[i], true) * 0.02, true);
-			if (approx.size() == 4 &&
-				fabs(contourArea(approx)) > 1000 &&
-				isContourConvex(approx))
-			{
-				double maxCosine = 0;
-				for (int j = 2; j < 5; j++)
-				{
-					double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-					maxCosine = MAX(maxCosine, cosine);
+// decodes every candidate of a clip with DECODE_SAMPLE and DECODE_WARP and
+// compares the cell matrices. the fixed-threshold (boy/girl) decoder must
+// match bit for bit; the stacked decoder picks its Otsu level from a
+// supersampled patch, so its differences are reported but not asserted.
+// the frames whose markers differ between batched and per-candidate
+// decoding are reported as well: the batch maps round differently from
+// the 8x8 solve in the last bits.
+int testSampling(const MarkerDictionary& dictionary, const string& video) {
+	VideoCapture capture(video);
+	Mat input, frame;
+
+	MarkerDetector detectors[2] = { MarkerDetector(dictionary, false), MarkerDetector(dictionary, true) };
+	const char* names[2] = { "fixed", "stacked" };
+	size_t candidates[2] = { 0, 0 }, mismatches[2] = { 0, 0 }, batchMismatches[2] = { 0, 0 };
+	vector<DetectedMarker> single, batched;
+
+	int frames = 0;
+	while (capture.read(input)) {
+		resize(input, frame, Size(640, 360));
+		frames++;
+
+		for (int d = 0; d < 2; d++) {
+			MarkerDetector& detector = detectors[d];
+			detector.preprocess(frame);
+			detector.findCandidates();
+
+			const vector<MarkerQuad>& quads = detector.quads();
+			for (size_t q = 0; q < quads.size(); q++) {
+				int sampled[11][11], warped[11][11];
+				detector.setDecodeMode(DECODE_SAMPLE);
+				bool sampledOk = detector.readMarkerMatrix(detector.binary(), quads[q].corners, sampled);
+				detector.setDecodeMode(DECODE_WARP);
+				bool warpedOk = detector.readMarkerMatrix(detector.binary(), quads[q].corners, warped);
+
+				candidates[d]++;
+				if (sampledOk != warpedOk || (sampledOk && memcmp(sampled, warped, sizeof(sampled)) != 0)) {
+					mismatches[d]++;
+					printf("frame %d candidate %d: %s matrices differ\n", frames - 1, (int)q, names[d]);
 				}
-				if (maxCosine < 0.3) {
-					approx = orderContour(approx);
-					if(approx.size() == 4) {
-						int m = processMarker2(bin, approx);
-
-						if (m >= 0) {
-							printf("Marker ID: %d\n", m);
-
-							vector<Point2f> objectPoints;
-							objectPoints.push_back(Point(0, 0));
-							objectPoints.push_back(Point(boy_front.cols, 0));
-							objectPoints.push_back(Point(boy_front.cols, boy_front.rows));
-							objectPoints.push_back(Point(0, boy_front.rows));
-
-							approx = orderContour2(approx, m);
-
-							Mat h = findHomography(objectPoints, approx, RANSAC, 3);
-
-							Mat mini;
-
-							switch (m) {
-							case 0:
-							case 1:
-							case 2:
-							case 3:mini = boy_front; break;
-							case 4:
-							case 5:
-							case 6:
-							case 7: mini = boy_back; break;
-							case 8:
-							case 9:
-							case 10:
-							case 11: mini = girl_front; break;
-							default: mini = girl_back; break;
-							}
-
-							warpPerspective(mini, frame, h, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-						}
-					}
+			}
 
-				}
+			detector.setDecodeMode(DECODE_SAMPLE);
+			detector.setBatchDecoding(false);
+			detector.decodeCandidates(single);
+			detector.setBatchDecoding(true);
+			detector.decodeCandidates(batched);
+			bool same = single.size() == batched.size();
+			for (size_t i = 0; same && i < single.size(); i++) {
+				same = single[i].id == batched[i].id && single[i].rotation == batched[i].rotation && single[i].side == batched[i].side;
+			}
+			if (!same) {
+				batchMismatches[d]++;
+				printf("frame %d: %s batched markers differ\n", frames - 1, names[d]);
 			}
 		}
-		frame.copyTo(full4);
-
-		// dependendo do ID do arquivo encontrado, atribuir uma ordem especfica para os pontos do contorno
-		// aplicar um warp especifico na imagem de saida	
-
-		//exibe o resultado final
-		//imshow("Front/Back sample application", frame);
-		imshow("Front/Back sample application", full);
-		waitKey(1);
+	}
 
-		char filename[100];
-		sprintf_s(filename, "output/%04d.jpg", counter++);
-		imwrite(filename, full);
+	if (frames == 0) {
+		cerr << "could not read " << video << endl;
+		return 1;
 	}
 
+	for (int d = 0; d < 2; d++) {
+		printf("%s: %d frames, %d candidates, %d mismatching matrices, %d frames with differing batched markers\n", names[d], frames,
+			(int)candidates[d], (int)mismatches[d], (int)batchMismatches[d]);
+	}
 
+	bool passed = mismatches[0] == 0;
+	printf("%s\n", passed ? "PASSED" : "FAILED");
+	return passed ? 0 : 1;
 }
 
-void color_application() {
+// frames of a video file or of the images of a directory (in name order)
+class FrameSource {
+public:
+	bool open(const string& path) {
+		next = 0;
+		files.clear();
+		if (std::filesystem::is_directory(path)) {
+			for (const auto& entry : std::filesystem::directory_iterator(path)) {
+				if (entry.is_regular_file()) files.push_back(entry.path().string());
+			}
+			std::sort(files.begin(), files.end());
+			return !files.empty();
+		}
+		return capture.open(path);
+	}
 
-	// carregar as imagens do menino e da menina
+	// name is the image file name, or the frame index for a video
+	bool read(Mat& frame, string& name) {
+		if (!capture.isOpened()) {
+			while (next < files.size()) {
+				name = files[next++];
+				frame = imread(name, 1);
+				if (!frame.empty()) return true;
+			}
+			return false;
+		}
+		name = to_string(next++);
+		return capture.read(frame);
+	}
 
-	Mat marker4 = imread("marker4_.jpg", 1);
-	Mat marker5 = imread("marker5_.jpg");
+private:
+	VideoCapture capture;
+	vector<string> files;
+	size_t next;
+};
+
+struct BatchOptions {
+	string input, output;
+	bool csv = false;
+	bool stacked = false;
+	bool adaptive = false;
+	bool mser = false;
+	int threads = 1;
+	int track = 0;
+	int votes = 0;
+	Size size;
+	bool refine = false;
+	string intrinsics;
+	double markerSize = 1;
+	string trace;
+};
+
+static string jsonString(const string& text) {
+	string result = "\"";
+	for (size_t i = 0; i < text.size(); i++) {
+		if (text[i] == '"' || text[i] == '\\') result += '\\';
+		result += text[i];
+	}
+	return result + "\"";
+}
 
-	Mat yellow;
-	yellow.create(11, 11, CV_8UC3);
-	Mat blue = yellow.clone();
-	Mat green = yellow.clone();
+// value below which a fraction p of the sorted samples falls
+static double percentile(const vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t index = (size_t)ceil(p * sorted.size());
+	return sorted[index > 0 ? index - 1 : 0];
+}
 
-	yellow = Scalar(0,255,255);
-	blue = Scalar(255,0,0);
-	green = Scalar(0,128,0);
+// headless run over a video or an image directory: no window, no camera.
+// detections go to options.output (stdout by default) as one JSON object
+// per frame or one CSV row per marker; per-stage p50/p95/p99 times and the
+// throughput go to stderr. with --trace the stages are profiled: the
+// rolling snapshot goes to stderr and the events to the trace file.
+int runBatch(const MarkerDictionary& dictionary, const BatchOptions& options) {
+	FrameSource source;
+	if (!source.open(options.input)) {
+		cerr << "could not open " << options.input << endl;
+		return 1;
+	}
 
-	// inciar a camera
-	VideoCapture capture;
-	//capture.open(0);
-	capture.open("4e5.avi");
+	std::ofstream file;
+	if (!options.output.empty()) {
+		file.open(options.output);
+		if (!file) {
+			cerr << "could not write " << options.output << endl;
+			return 1;
+		}
+	}
+	ostream& out = options.output.empty() ? cout : file;
+
+	MarkerDetector detector(dictionary, options.stacked);
+	detector.setThreads(options.threads);
+	if (options.adaptive) detector.setFrontEnd(FRONTEND_ADAPTIVE);
+	if (options.mser) detector.setFrontEnd(FRONTEND_MSER);
+	detector.setTemporalVoting(options.votes);
+	MarkerTracker tracker(detector, options.track);
+
+	MarkerPoseEstimator estimator;
+	estimator.setMarkerSize(options.markerSize);
+	if (!options.intrinsics.empty() && !estimator.loadIntrinsics(options.intrinsics)) {
+		cerr << "could not read camera_matrix from " << options.intrinsics << endl;
+		return 1;
+	}
 
-	Mat frame, bin, gray, bin2, gray2;
-	vector<vector<Point> > contours;
+	Profiler profiler(1000);
+	if (!options.trace.empty()) {
+#ifndef TM_TRACE
+		fprintf(stderr, "built without TM_TRACE: the trace and the snapshot stay empty\n");
+#endif
+		detector.setProfiler(&profiler);
+		estimator.setProfiler(&profiler);
+		profiler.startTrace();
+	}
 
-	Mat full;
-	full.create(720, 1280, CV_8UC3);
+	enum { READ, PREPROCESS, CANDIDATES, DECODE, TRACK, REFINE, TOTAL, STAGES };
+	const char* stageNames[STAGES] = { "read", "preprocess", "candidates", "decode", "track", "refine", "total" };
+	vector<double> times[STAGES];
 
-	Mat full1 = full(Rect(0, 0, 640, 360));
-	Mat full2 = full(Rect(640, 0, 640, 360));
-	Mat full3 = full(Rect(0, 360, 640, 360));
-	Mat full4 = full(Rect(640, 360, 640, 360));
+	if (options.csv) {
+		out << "frame,name,id,rotation,side,stacked,confidence,x0,y0,x1,y1,x2,y2,x3,y3";
+		if (estimator.hasIntrinsics()) out << ",rx,ry,rz,tx,ty,tz";
+		out << '\n';
+	}
 
-	int counter = 0;
+	Mat input, frame;
+	string name;
+	vector<DetectedMarker> markers;
+	vector<MarkerPose> poses;
+	int frames = 0;
+	int64 cachedDecodes = 0, heldResults = 0;
+	int64 start = getTickCount();
 
-	// criar o loop principal da aplicacao
 	while (true) {
-		full = 0;
-		
-		// ler o frame da camera
-		capture.read(frame);
-		resize(frame, frame, Size(640, 360));
-
-		frame.copyTo(full1);
-
-		cvtColor(frame, gray, COLOR_BGR2GRAY);
+		int64 t0 = getTickCount();
+		if (!source.read(input, name)) break;
+		if (options.size.area() > 0) resize(input, frame, options.size);
+		else frame = input;
+		int64 t1 = getTickCount();
+		if (options.track > 0) {
+			tracker.track(frame, markers);
+			int64 t2 = getTickCount();
+			times[TRACK].push_back((t2 - t1) * 1000.0 / getTickFrequency());
+			times[TOTAL].push_back((t2 - t0) * 1000.0 / getTickFrequency());
+		}
+		else {
+			detector.preprocess(frame);
+			int64 t2 = getTickCount();
+			detector.findCandidates();
+			int64 t3 = getTickCount();
+			detector.decodeCandidates(markers);
+			int64 t4 = getTickCount();
+			cachedDecodes += detector.votingStats().cached;
+			heldResults += detector.votingStats().held;
+
+			times[PREPROCESS].push_back((t2 - t1) * 1000.0 / getTickFrequency());
+			times[CANDIDATES].push_back((t3 - t2) * 1000.0 / getTickFrequency());
+			times[DECODE].push_back((t4 - t3) * 1000.0 / getTickFrequency());
+			times[TOTAL].push_back((t4 - t0) * 1000.0 / getTickFrequency());
+		}
+		times[READ].push_back((t1 - t0) * 1000.0 / getTickFrequency());
+
+		if (options.refine) {
+			int64 t5 = getTickCount();
+			estimator.estimate(frame, markers, poses);
+			double refineMs = (getTickCount() - t5) * 1000.0 / getTickFrequency();
+			times[REFINE].push_back(refineMs);
+			times[TOTAL].back() += refineMs;
+		}
 
-		// processar o marcador
-		threshold(gray, bin, 64, 255, THRESH_BINARY);
-		//cvtColor(bin, bin2, COLOR_GRAY2BGR);
-		//bin2.copyTo(full2);
+		if (options.csv) {
+			for (size_t i = 0; i < markers.size(); i++) {
+				const DetectedMarker& m = markers[i];
+				out << frames << ',' << name << ',' << m.id << ',' << m.rotation << ',' << m.side << ',' << m.stacked << ',' << m.confidence;
+				// corners in template order, refined or not
+				Point corners[4];
+				templateCorners(m.corners, m.rotation, m.side, corners);
+				for (int c = 0; c < 4; c++) {
+					if (options.refine) out << ',' << poses[i].corners[c].x << ',' << poses[i].corners[c].y;
+					else out << ',' << corners[c].x << ',' << corners[c].y;
+				}
+				if (estimator.hasIntrinsics()) {
+					// empty fields when solvePnP failed
+					for (int k = 0; k < 3; k++) out << ',' << (poses[i].hasPose ? to_string(poses[i].rvec[k]) : "");
+					for (int k = 0; k < 3; k++) out << ',' << (poses[i].hasPose ? to_string(poses[i].tvec[k]) : "");
+				}
+				out << '\n';
+			}
+		}
+		else {
+			out << "{\"frame\":" << frames << ",\"name\":" << jsonString(name) << ",\"markers\":[";
+			for (size_t i = 0; i < markers.size(); i++) {
+				const DetectedMarker& m = markers[i];
+				out << (i ? "," : "") << "{\"id\":" << m.id << ",\"rotation\":" << m.rotation << ",\"side\":" << m.side << ",\"stacked\":" << m.stacked << ",\"confidence\":" << m.confidence << ",\"corners\":[";
+				Point corners[4];
+				templateCorners(m.corners, m.rotation, m.side, corners);
+				for (int c = 0; c < 4; c++) {
+					out << (c ? "," : "") << '[';
+					if (options.refine) out << poses[i].corners[c].x << ',' << poses[i].corners[c].y << ']';
+					else out << corners[c].x << ',' << corners[c].y << ']';
+				}
+				out << ']';
+				if (options.refine && poses[i].hasPose) {
+					out << ",\"rvec\":[" << poses[i].rvec[0] << ',' << poses[i].rvec[1] << ',' << poses[i].rvec[2] << ']';
+					out << ",\"tvec\":[" << poses[i].tvec[0] << ',' << poses[i].tvec[1] << ',' << poses[i].tvec[2] << ']';
+				}
+				out << '}';
+			}
+			out << "]}\n";
+		}
+		frames++;
+		if (!options.trace.empty()) profiler.endFrame();
+	}
 
-		Canny(bin, gray, 0, thresh, 5);
-		//cvtColor(gray, gray2, COLOR_GRAY2BGR);
-		//gray2.copyTo(full3);
+	double seconds = (getTickCount() - start) / getTickFrequency();
+	fprintf(stderr, "%d frames in %.2f s, %.1f frames/s\n", frames, seconds, frames / max(seconds, 1e-9));
+	if (options.track > 0) {
+		fprintf(stderr, "tracking: %d full detections, %d tracked frames\n", tracker.fullDetections(), tracker.trackedFrames());
+	}
+	else if (options.votes > 0) {
+		fprintf(stderr, "voting: %lld decodes reused, %lld results held against the current decode\n", (long long)cachedDecodes, (long long)heldResults);
+	}
+	fprintf(stderr, "%-12s %9s %9s %9s\n", "stage (ms)", "p50", "p95", "p99");
+	for (int s = 0; s < STAGES; s++) {
+		if (times[s].empty()) continue;
+		std::sort(times[s].begin(), times[s].end());
+		fprintf(stderr, "%-12s %9.3f %9.3f %9.3f\n", stageNames[s],
+			percentile(times[s], 0.50), percentile(times[s], 0.95), percentile(times[s], 0.99));
+	}
+	if (!options.trace.empty()) {
+		profiler.stopTrace();
+		profiler.printSnapshot(stderr);
+		if (!profiler.writeTrace(options.trace)) {
+			cerr << "could not write " << options.trace << endl;
+			return 1;
+		}
+	}
+	return frames > 0 ? 0 : 1;
+}
 
-		//imshow("bin", bin);
-		//imshow("gray", gray);
+// batch <video|directory> [--csv] [--output file] [--stacked] [--adaptive|--mser] [--threads n] [--size WxH] [--track n]
+//       [--votes k] [--refine] [--intrinsics camera.yml] [--marker-size s] [--trace file]
+static bool parseBatchOptions(int argc, char** argv, BatchOptions& options) {
+	if (argc < 3) return false;
+	options.input = argv[2];
+	for (int i = 3; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--csv") options.csv = true;
+		else if (arg == "--json") options.csv = false;
+		else if (arg == "--stacked") options.stacked = true;
+		else if (arg == "--adaptive") options.adaptive = true;
+		else if (arg == "--mser") options.mser = true;
+		else if (arg == "--output" && hasValue) options.output = argv[++i];
+		else if (arg == "--threads" && hasValue) options.threads = atoi(argv[++i]);
+		else if (arg == "--track" && hasValue) options.track = atoi(argv[++i]);
+		else if (arg == "--votes" && hasValue) options.votes = atoi(argv[++i]);
+		else if (arg == "--refine") options.refine = true;
+		else if (arg == "--intrinsics" && hasValue) {
+			options.intrinsics = argv[++i];
+			options.refine = true;
+		}
+		else if (arg == "--marker-size" && hasValue) options.markerSize = atof(argv[++i]);
+		else if (arg == "--trace" && hasValue) options.trace = argv[++i];
+		else if (arg == "--size" && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &options.size.width, &options.size.height) != 2) return false;
+		}
+		else return false;
+	}
+	return true;
+}
 
-		findContours(gray, contours, RETR_CCOMP, CHAIN_APPROX_SIMPLE);
+// generate-scenes <directory> [count] [--size WxH] [--count n] [--stack n] [--seed s]:
+// writes count synthetic scenes as scene_NNNN.png and their ground truth
+// as truth.csv, in the columns of the batch CSV output (the name is the
+// image path batch reports for the directory)
+int generateScenes(const MarkerDictionary& dictionary, int argc, char** argv) {
+	string directory = argv[2];
+	int scenes = 100;
+	uint64 seed = 1;
+	SceneOptions options;
+	for (int i = 3; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--size" && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &options.size.width, &options.size.height) != 2) return -1;
+		}
+		else if (arg == "--count" && hasValue) options.markers = atoi(argv[++i]);
+		else if (arg == "--stack" && hasValue) options.maxStack = max(1, atoi(argv[++i]));
+		else if (arg == "--seed" && hasValue) seed = strtoull(argv[++i], 0, 10);
+		else if (arg[0] != '-' && i == 3) scenes = atoi(argv[i]);
+		else return -1;
+	}
+	// sides scale with the frame, as in bench-synthetic
+	options.minSide = options.size.height / 8.0;
+	options.maxSide = options.size.height / 4.0;
+
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	ofstream truthFile(directory + "/truth.csv");
+	if (!truthFile) {
+		cerr << "could not write " << directory << "/truth.csv" << endl;
+		return 1;
+	}
+	truthFile << "frame,name,id,rotation,side,stacked,x0,y0,x1,y1,x2,y2,x3,y3\n";
+
+	SceneGenerator generator(dictionary, seed);
+	Mat frame;
+	vector<SceneMarker> truth;
+	char filename[32];
+	for (int n = 0; n < scenes; n++) {
+		generator.generate(options, frame, truth);
+		snprintf(filename, sizeof(filename), "/scene_%04d.png", n);
+		string name = directory + filename;
+		if (!imwrite(name, frame)) {
+			cerr << "could not write " << name << endl;
+			return 1;
+		}
+		for (size_t i = 0; i < truth.size(); i++) {
+			const SceneMarker& m = truth[i];
+			truthFile << n << ',' << name << ',' << m.id << ',' << m.rotation << ',' << m.side << ',' << m.stacked;
+			for (int c = 0; c < 4; c++) truthFile << ',' << m.corners[c].x << ',' << m.corners[c].y;
+			truthFile << '\n';
+		}
+	}
+	printf("%d scenes written to %s\n", scenes, directory.c_str());
+	return 0;
+}
 
-		vector<Point> approx;
+// serves many cameras and clips from one process: a reader thread per
+// stream keeps only the newest frame of its source, and a fixed set of
+// worker threads, each with its own MarkerDetector on the shared
+// dictionary, serves the stream with the earliest deadline: the latency
+// budget of the stream after it started waiting. a frame replaced by a
+// newer one keeps its stream waiting, so under overload every stream gets
+// its share instead of the ones whose frames happen to arrive first. a
+// frame replaced before a worker took it, or whose own budget passed while
+// it waited, is dropped, so an overloaded host sheds stale frames instead
+// of queueing latency. a stream is on at most one worker at a time,
+// so its frames are detected in order. workers are not tied to streams:
+// with sources of different sizes a detector regrows its buffers when it
+// switches size.
+class StreamServer {
+public:
+	// threads <= 0: one worker per core
+	StreamServer(const MarkerDictionary& dictionary, bool stacked, int threads)
+		: dictionary(dictionary), stacked(stacked), workerCount(threads > 0 ? threads : max(1, (int)std::thread::hardware_concurrency())) {}
+	~StreamServer() { stop(); }
+
+	// source is a camera index or a video file, played at its frame rate;
+	// budgetMs is the longest a frame may wait for a worker
+	bool addStream(const string& source, double budgetMs) {
+		std::unique_ptr<Stream> stream(new Stream);
+		stream->source = source;
+		stream->live = !source.empty() && strspn(source.c_str(), "0123456789") == source.size();
+		bool opened = stream->live ? stream->capture.open(atoi(source.c_str())) : stream->capture.open(source);
+		if (!opened) return false;
+		double fps = stream->capture.get(CAP_PROP_FPS);
+		stream->period = 1.0 / (fps > 0 && fps < 1000 ? fps : 30);
+		stream->budget = budgetMs / 1000;
+		streams.push_back(std::move(stream));
+		return true;
+	}
 
-		//printf("%d\n", contours.size());
+	void start() {
+		stopping = false;
+		startTime = lastReport = getTickCount();
+		for (size_t i = 0; i < streams.size(); i++) {
+			streams[i]->reader = std::thread(&StreamServer::readLoop, this, streams[i].get());
+		}
+		for (int i = 0; i < workerCount; i++) workers.push_back(std::thread(&StreamServer::workLoop, this));
+	}
 
-		for (size_t i = 0; i < contours.size(); i++)
+	void stop() {
 		{
-			approxPolyDP(contours[i], approx, arcLength(contours[i], true) * 0.02, true);
-			if (approx.size() == 4 &&
-				fabs(contourArea(approx)) > 1000 &&
-				isContourConvex(approx))
-			{
-				double maxCosine = 0;
-				for (int j = 2; j < 5; j++)
-				{
-					double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-					maxCosine = MAX(maxCosine, cosine);
-				}
-				if (maxCosine < 0.3) {
-					approx = orderContour(approx);
-					if (approx.size() == 4) {
-						vector<int> ms = processMarker(bin, approx);
-
-						vector<Point2f> objectPoints;
-						objectPoints.push_back(Point(0, 0));
-						objectPoints.push_back(Point(9, 0));
-						objectPoints.push_back(Point(9, 9));
-						objectPoints.push_back(Point(0, 9));
-
-						Mat h = findHomography(objectPoints, approx, RANSAC, 3);
-
-						for (int k = 0; k < ms.size(); k++) {
-							printf("Marker ID [%d]: %d\n", k, ms[k]);
-							if ((ms[k] / 8) == 0) {
-								warpPerspective(yellow, frame, h, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-								
-								vector<Point2f> objectPoints2;
-								objectPoints2.push_back(Point(20, 20));
-								objectPoints2.push_back(Point(90, 20));
-								objectPoints2.push_back(Point(90, 90));
-								objectPoints2.push_back(Point(20, 90));
-
-								Mat h2 = findHomography(objectPoints2, approx, RANSAC, 3);
-								
-								warpPerspective(marker4, full2, h2, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-
-								/*for (int j = 0; j < 4; j++) {
-									line(full2, approx[j], approx[(j + 1) % 4], Scalar(255, 255, 255), 1);
-								}*/
-							}
-							else {
-								warpPerspective(blue, frame, h, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-
-								vector<Point2f> objectPoints2;
-								objectPoints2.push_back(Point(20, 20));
-								objectPoints2.push_back(Point(90, 20));
-								objectPoints2.push_back(Point(90, 90));
-								objectPoints2.push_back(Point(20, 90));
-
-								Mat h2 = findHomography(objectPoints2, approx, RANSAC, 3);
-
-								warpPerspective(marker5, full3, h2, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-
-								/*for (int j = 0; j < 4; j++) {
-									line(full3, approx[j], approx[(j + 1) % 4], Scalar(255, 255, 255), 1);
-								}*/
-							}
-						}
-
-						if ((ms.size() == 2)) {
-							warpPerspective(green, frame, h, Size(frame.cols, frame.rows), 1, BORDER_TRANSPARENT);
-						}
-						printf("ms size: %d\n", ms.size());
-					}
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		frameReady.notify_all();
+		for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+		workers.clear();
+		for (size_t i = 0; i < streams.size(); i++) {
+			if (streams[i]->reader.joinable()) streams[i]->reader.join();
+		}
+	}
 
-				}
-			}
+	// true until every clip has ended and its last frame is done
+	bool running() const {
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t i = 0; i < streams.size(); i++) {
+			const Stream& s = *streams[i];
+			if (!s.ended || s.pending >= 0 || s.processing >= 0) return true;
 		}
-		frame.copyTo(full4);
+		return false;
+	}
 
-		// dependendo do ID do arquivo encontrado, atribuir uma ordem especfica para os pontos do contorno
-		// aplicar um warp especifico na imagem de saida	
+	// one line per stream since the last report: frames/s, capture-to-result
+	// latency, frames dropped as replaced and as late, markers per frame
+	void printReport(FILE* out) {
+		std::lock_guard<std::mutex> guard(lock);
+		int64 now = getTickCount();
+		double seconds = max((now - lastReport) / getTickFrequency(), 1e-9);
+		lastReport = now;
+		fprintf(out, "%-3s %-24s %7s %9s %9s %9s %8s %6s %7s\n", "#", "stream", "fps", "p50 ms", "p95 ms", "max ms", "replaced", "late", "markers");
+		for (size_t i = 0; i < streams.size(); i++) {
+			Stream& s = *streams[i];
+			std::sort(s.latencies.begin(), s.latencies.end());
+			string name = s.source.size() > 24 ? "..." + s.source.substr(s.source.size() - 21) : s.source;
+			fprintf(out, "%-3d %-24s %7.1f %9.2f %9.2f %9.2f %8d %6d %7.2f\n", (int)i, name.c_str(), s.frames / seconds,
+				percentile(s.latencies, 0.50), percentile(s.latencies, 0.95), s.latencies.empty() ? 0.0 : s.latencies.back(),
+				s.replaced, s.late, s.frames ? (double)s.markers / s.frames : 0.0);
+			s.frames = s.replaced = s.late = 0;
+			s.markers = 0;
+			s.latencies.clear();
+		}
+		fprintf(out, "%d workers, %.1f s\n", workerCount, (now - startTime) / getTickFrequency());
+	}
 
-		//exibe o resultado final
-		//imshow("Front/Back sample application", frame);
-		imshow("Color sample application", full);
-		waitKey(1);
+private:
+	// three frame buffers per stream: the reader fills one, one waits for a
+	// worker (pending) and one is being detected (processing)
+	struct Stream {
+		string source;
+		VideoCapture capture;
+		bool live = false;
+		double period = 0, budget = 0; // seconds
+		std::thread reader;
+
+		Mat slots[3];
+		int64 captured[3] = {};
+		int pending = -1, processing = -1;
+		int64 waiting = 0; // since the first frame not yet served
+		bool ended = false;
+
+		int frames = 0, replaced = 0, late = 0;
+		int64 markers = 0;
+		vector<double> latencies; // ms, since the last report
+	};
+
+	void readLoop(Stream* stream) {
+		int writing = 0;
+		int64 next = getTickCount();
+		while (true) {
+			if (!stream->live) {
+				// clips are paced like a camera
+				int64 wait = next - getTickCount();
+				if (wait > 0) std::this_thread::sleep_for(std::chrono::microseconds((int64)(wait * 1e6 / getTickFrequency())));
+				next += (int64)(stream->period * getTickFrequency());
+			}
+			bool read = stream->capture.read(stream->slots[writing]);
+			int64 captured = getTickCount();
 
-		char filename[100];
-		sprintf_s(filename, "output/%04d.jpg", counter++);
-		imwrite(filename, full);
+			std::lock_guard<std::mutex> guard(lock);
+			if (!read || stopping) {
+				stream->ended = true;
+				return;
+			}
+			stream->captured[writing] = captured;
+			int previous = stream->pending;
+			if (previous < 0) stream->waiting = captured;
+			stream->pending = writing;
+			if (previous >= 0) {
+				stream->replaced++;
+				writing = previous;
+			}
+			else {
+				// the slot that is neither pending nor processing
+				for (writing = 0; writing == stream->pending || writing == stream->processing; writing++);
+			}
+			frameReady.notify_one();
+		}
 	}
 
+	// the waiting stream with the earliest deadline, dropping late frames;
+	// the lock is held
+	Stream* nextStream(int64 now) {
+		Stream* best = 0;
+		int64 bestDeadline = 0;
+		for (size_t i = 0; i < streams.size(); i++) {
+			Stream* s = streams[i].get();
+			if (s->pending < 0 || s->processing >= 0) continue;
+			int64 budget = (int64)(s->budget * getTickFrequency());
+			if (s->captured[s->pending] + budget < now) {
+				s->pending = -1;
+				s->late++;
+				continue;
+			}
+			int64 deadline = s->waiting + budget;
+			if (!best || deadline < bestDeadline) {
+				best = s;
+				bestDeadline = deadline;
+			}
+		}
+		return best;
+	}
 
-}
-
+	void workLoop() {
+		MarkerDetector detector(dictionary, stacked);
+		vector<DetectedMarker> markers;
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			Stream* stream = 0;
+			frameReady.wait(guard, [&] { return stopping || (stream = nextStream(getTickCount())) != 0; });
+			if (stopping) return;
+			int slot = stream->pending;
+			stream->processing = slot;
+			stream->pending = -1;
+
+			guard.unlock();
+			detector.detect(stream->slots[slot], markers);
+			int64 done = getTickCount();
+			guard.lock();
+
+			stream->processing = -1;
+			stream->frames++;
+			stream->markers += markers.size();
+			stream->latencies.push_back((done - stream->captured[slot]) * 1000.0 / getTickFrequency());
+			// another frame of this stream may have waited for this one
+			if (stream->pending >= 0) frameReady.notify_one();
+		}
+	}
 
+	const MarkerDictionary& dictionary;
+	bool stacked;
+	int workerCount;
+	vector<std::unique_ptr<Stream> > streams;
+	vector<std::thread> workers;
+	mutable std::mutex lock;
+	std::condition_variable frameReady;
+	bool stopping = false;
+	int64 startTime = 0, lastReport = 0;
+};
+
+// serve <source>[@budget] ... [--threads n] [--budget ms] [--stacked] [--seconds s] [--interval s]:
+// detects markers in every source with one shared worker pool and prints
+// the per-stream report every interval seconds, until the clips end or
+// seconds have passed. a source is a camera index or a video file; the
+// budget (default 100 ms) can be set per source as clip.avi@50.
+int runServer(const MarkerDictionary& dictionary, int argc, char** argv) {
+	int threads = 0;
+	double budget = 100, seconds = 0, interval = 2;
+	bool stacked = false;
+	vector<string> sources;
+	for (int i = 2; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--threads" && hasValue) threads = atoi(argv[++i]);
+		else if (arg == "--budget" && hasValue) budget = atof(argv[++i]);
+		else if (arg == "--stacked") stacked = true;
+		else if (arg == "--seconds" && hasValue) seconds = atof(argv[++i]);
+		else if (arg == "--interval" && hasValue) interval = max(0.1, atof(argv[++i]));
+		else if (arg[0] != '-') sources.push_back(arg);
+		else return -1;
+	}
+	if (sources.empty()) return -1;
+
+	StreamServer server(dictionary, stacked, threads);
+	for (size_t i = 0; i < sources.size(); i++) {
+		// clip.avi@50: budget of this stream
+		size_t at = sources[i].rfind('@');
+		string source = at == string::npos ? sources[i] : sources[i].substr(0, at);
+		double streamBudget = at == string::npos ? budget : atof(sources[i].c_str() + at + 1);
+		if (!server.addStream(source, streamBudget)) {
+			cerr << "could not open " << source << endl;
+			return 1;
+		}
+	}
 
+	server.start();
+	int64 start = getTickCount();
+	while (server.running()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds((int)(interval * 1000)));
+		server.printReport(stderr);
+		if (seconds > 0 && (getTickCount() - start) / getTickFrequency() >= seconds) break;
+	}
+	server.stop();
+	return 0;
+}
 
 int main(int argc, char** argv)
 {
-	loadMarkerTemplates();
-	boygirl_application();
-	//color_application();
-	//test();
-	exit(0);
-	
-	
-	loadMarkerTemplates();
-	cout << markerTemplates.size() << endl;
-
-	Mat image = imread("test2.jpg", 0);
-	vector<vector<Point> > contours, squares;
+	// options before the command: [--markers dir] [--assets dir] [--output file] [--color] [--trace file]
+	string markers, assets = ".", output = "output.avi", trace;
+	bool color = false;
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+		string arg = argv[first];
+		bool hasValue = first + 1 < argc;
+		if (arg == "--markers" && hasValue) markers = argv[++first];
+		else if (arg == "--assets" && hasValue) assets = argv[++first];
+		else if (arg == "--output" && hasValue) output = argv[++first];
+		else if (arg == "--color") color = true;
+		else if (arg == "--trace" && hasValue) trace = argv[++first];
+		else {
+			help(argv[0]);
+			return 1;
+		}
+	}
+	// the options are dropped, so argv[1] is the command below
+	argv[first - 1] = argv[0];
+	argv += first - 1;
+	argc -= first - 1;
 
-	Mat image2, bin, gray;
-	// image should contain the frame to be processed
+	if (markers.empty()) markers = assets + "/numbers";
 
-	medianBlur(image, image2, 7);
+	// test-allocations [clip.avi]: proves detect() does not allocate per frame
+	if (argc > 1 && string(argv[1]) == "test-allocations") {
+		return testAllocations(markers, argc > 2 ? argv[2] : "");
+	}
 
-	threshold(image2, bin, 128, 255, THRESH_OTSU);
+	// test-voting: a changed template is reported within ceil(votes / 2) frames
+	if (argc > 1 && string(argv[1]) == "test-voting") {
+		return testVoting(markers);
+	}
 
-	Canny(bin, gray, 0, thresh, 5);
+	MarkerDictionary dictionary;
+	if (!dictionary.load(markers)) {
+		cerr << "could not load marker templates from " << markers << endl;
+		return 1;
+	}
 
-	imshow("bin", bin);
-	imshow("gray", gray);
+	// compile-dictionary markers.tpm: writes the templates as a binary dictionary for --markers
+	if (argc > 2 && string(argv[1]) == "compile-dictionary") {
+		if (!dictionary.save(argv[2])) {
+			cerr << "could not write " << argv[2] << endl;
+			return 1;
+		}
+		printf("%d templates (%d variants) written to %s\n", dictionary.size(), dictionary.variants(), argv[2]);
+		return 0;
+	}
 
-	findContours(gray, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+	// generate-scenes dir [count]: synthetic frames with ground truth
+	if (argc > 2 && string(argv[1]) == "generate-scenes") {
+		int result = generateScenes(dictionary, argc, argv);
+		if (result < 0) help(argv[0]);
+		return result < 0 ? 1 : result;
+	}
 
-	vector<Point> approx;
+	// test-sampling clip.avi: DECODE_SAMPLE and DECODE_WARP decode the same matrices
+	if (argc > 2 && string(argv[1]) == "test-sampling") {
+		return testSampling(dictionary, argv[2]);
+	}
 
-	printf("%d\n", contours.size());
+	// serve clip.avi 0 ...: many streams on one shared worker pool
+	if (argc > 2 && string(argv[1]) == "serve") {
+		int result = runServer(dictionary, argc, argv);
+		if (result < 0) help(argv[0]);
+		return result < 0 ? 1 : result;
+	}
 
-	for (size_t i = 0; i < contours.size(); i++)
-	{
-		approxPolyDP(contours[i], approx, arcLength(contours[i], true) * 0.02, true);
-		if (approx.size() == 4 &&
-			fabs(contourArea(approx)) > 1000 &&
-			isContourConvex(approx))
-		{
-			double maxCosine = 0;
-			for (int j = 2; j < 5; j++)
-			{
-				double cosine = fabs(angle(approx[j % 4], approx[j - 2], approx[j - 1]));
-				maxCosine = MAX(maxCosine, cosine);
-			}
-			if (maxCosine < 0.3) {
-				squares.push_back(approx);
-				processMarker(image, approx);
-			}
+	// batch clip.avi|dir: headless detection with JSON/CSV output and timings
+	if (argc > 1 && string(argv[1]) == "batch") {
+		BatchOptions options;
+		if (!parseBatchOptions(argc, argv, options)) {
+			help(argv[0]);
+			return 1;
 		}
+		return runBatch(dictionary, options);
 	}
 
-	//printf("%d\n", squares.size());
+	if (argc > 1) {
+		help(argv[0]);
+		return 1;
+	}
 
-	cvtColor(image, image, COLOR_GRAY2BGR);
+	// the samples tell the faces apart by template image, so they read the
+	// images even when the dictionary is a compiled file
+	TemplateImages images;
+	string imageDirectory = std::filesystem::is_directory(markers) ? markers : assets + "/numbers";
+	if (!images.load(dictionary, imageDirectory)) {
+		cerr << "could not read the template images in " << imageDirectory << endl;
+		return 1;
+	}
 
-	for (int i = 0; i < squares.size(); i++) {
-		for (int j = 0; j < 4; j++) {
-			line(image, squares[i][j], squares[i][(j + 1) % 4], Scalar(0, 0, 255), 3);
-		}
-		imshow("test", image);
-		waitKey(0);
+	Profiler profiler;
+	if (!trace.empty()) profiler.startTrace();
+	Profiler* sampleProfiler = trace.empty() ? 0 : &profiler;
+	if (color) color_application(dictionary, images, assets, output, sampleProfiler);
+	else boygirl_application(dictionary, images, assets, output, sampleProfiler);
+	if (!trace.empty()) {
+		profiler.stopTrace();
+		if (!profiler.writeTrace(trace)) cerr << "could not write " << trace << endl;
 	}
-	
+	//test(assets);
 	return 0;
-}
\ No newline at end of file
+}
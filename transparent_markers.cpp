@@ -0,0 +1,2570 @@
+// Transparent marker detection library: see transparent_markers.hpp
+#include "transparent_markers.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs/imgcodecs.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/features2d/features2d.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace cv;
+using namespace std;
+
+namespace transparent {
+
+#ifdef TM_COUNT_ALLOCATIONS
+thread_local int openCvCallDepth = 0;
+#endif
+
+static inline int lowestBit(uint64_t v)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, v);
+	return (int)index;
+#else
+	return __builtin_ctzll(v);
+#endif
+}
+
+static inline int popcount(uint64_t v)
+{
+#ifdef _MSC_VER
+	return (int)__popcnt64(v);
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+// binary dictionary: this header, then the payload
+//   uint32_t codes[count][SIDES][ROTATIONS]
+//   uint32_t variantCodes[variants], padded to an even count
+//   uint64_t cellTemplates[CELLS][words]
+//   uint32_t nameOffsets[count + 1]
+//   char names[nameBytes] (each name 0-terminated)
+// in host byte order; a file from a host of the other byte order fails on
+// the magic number. checksum is the 64-bit FNV-1a of the payload.
+struct DictionaryHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t variants;
+	uint32_t words;
+	uint32_t grid;
+	uint32_t rotations;
+	uint32_t sides;
+	uint64_t payloadBytes;
+	uint64_t checksum;
+};
+
+static const uint32_t DICTIONARY_MAGIC = 0x314d5054; // "TPM1"
+static const uint32_t DICTIONARY_VERSION = 2;
+
+static uint64_t fnv1a(const unsigned char* bytes, size_t size) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// size of the payload before the names
+static size_t tableBytes(size_t count, size_t variants, size_t words) {
+	return count * MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS * sizeof(uint32_t) +
+		((variants + 1) & ~(size_t)1) * sizeof(uint32_t) +
+		MarkerDictionary::CELLS * words * sizeof(uint64_t) + (count + 1) * sizeof(uint32_t);
+}
+
+MarkerDictionary::MarkerDictionary()
+	: mapped(0), mappedSize(0), data(0), dataSize(0), count(0), variantCount(0), words(0),
+	codes(0), variantCodes(0), cellTemplates(0), nameOffsets(0), names(0) {
+}
+
+MarkerDictionary::~MarkerDictionary() {
+	release();
+}
+
+void MarkerDictionary::release() {
+	if (mapped) {
+#ifdef _WIN32
+		UnmapViewOfFile(mapped);
+#else
+		munmap(mapped, mappedSize);
+#endif
+	}
+	mapped = 0;
+	mappedSize = 0;
+	owned.clear();
+	data = 0;
+	dataSize = 0;
+	count = variantCount = words = 0;
+}
+
+bool MarkerDictionary::load(const string& path) {
+	release();
+	if (std::filesystem::is_directory(path)) return loadDirectory(path);
+	return loadCompiled(path);
+}
+
+bool MarkerDictionary::readTemplate(const string& file, uint32_t& code) {
+	Mat image = imread(file, 0);
+	if (image.empty()) return false;
+	code = 0;
+	for (int i = 0; i < image.rows; i++) {
+		for (int j = 0; j < image.cols; j++) {
+			if (image.at<unsigned char>(i, j) != 0) continue;
+			if (i >= GRID || j >= GRID) {
+				cerr << "template " << file << " is larger than the 5x5 grid" << endl;
+				continue;
+			}
+			code |= 1u << (i * GRID + j);
+		}
+	}
+	return true;
+}
+
+bool MarkerDictionary::loadDirectory(const string& directory) {
+	// ids follow the sorted file names, not the directory order
+	vector<std::filesystem::path> files;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+		if (entry.is_regular_file()) files.push_back(entry.path());
+	}
+	std::sort(files.begin(), files.end(), [](const std::filesystem::path& a, const std::filesystem::path& b) {
+		return a.filename().string() < b.filename().string();
+	});
+
+	// all variants of each id, side-major; an image equal to a variant of
+	// an earlier id is the same marker in another orientation
+	vector<uint32_t> allCodes, distinct;
+	string templateNames;
+	vector<uint32_t> offsets;
+	for (size_t f = 0; f < files.size(); f++) {
+		uint32_t code;
+		if (!readTemplate(files[f].string(), code)) continue;
+		if (std::find(allCodes.begin(), allCodes.end(), code) != allCodes.end()) continue;
+
+		for (int side = 0; side < SIDES; side++) {
+			uint32_t variant = side ? mirror(code) : code;
+			for (int r = 0; r < ROTATIONS; r++) {
+				allCodes.push_back(variant);
+				variant = rotate(variant);
+			}
+		}
+		offsets.push_back((uint32_t)templateNames.size());
+		templateNames += files[f].filename().string();
+		templateNames += '\0';
+	}
+	if (error || allCodes.empty()) return false;
+	offsets.push_back((uint32_t)templateNames.size());
+
+	// symmetric templates repeat variants; the matcher tests each code once
+	size_t n = offsets.size() - 1;
+	vector<uint32_t> variantIndex;
+	for (size_t i = 0; i < n; i++) {
+		size_t first = i * SIDES * ROTATIONS;
+		for (size_t v = first; v < first + SIDES * ROTATIONS; v++) {
+			if (std::find(allCodes.begin() + first, allCodes.begin() + v, allCodes[v]) == allCodes.begin() + v) {
+				variantIndex.push_back((uint32_t)v);
+			}
+		}
+	}
+
+	// the same layout as a compiled file, in 64-bit words for alignment
+	size_t m = variantIndex.size(), w = (m + 63) / 64;
+	size_t payload = tableBytes(n, m, w) + templateNames.size();
+	owned.assign((sizeof(DictionaryHeader) + payload + 7) / 8, 0);
+	unsigned char* bytes = (unsigned char*)owned.data();
+
+	uint32_t* codeTable = (uint32_t*)(bytes + sizeof(DictionaryHeader));
+	std::copy(allCodes.begin(), allCodes.end(), codeTable);
+	uint32_t* variantTable = codeTable + allCodes.size();
+	std::copy(variantIndex.begin(), variantIndex.end(), variantTable);
+	uint64_t* cells = (uint64_t*)(variantTable + ((m + 1) & ~(size_t)1));
+	for (size_t v = 0; v < m; v++) {
+		for (int c = 0; c < CELLS; c++) {
+			if (allCodes[variantIndex[v]] & (1u << c)) cells[c * w + v / 64] |= 1ull << (v % 64);
+		}
+	}
+	uint32_t* nameTable = (uint32_t*)(cells + CELLS * w);
+	std::copy(offsets.begin(), offsets.end(), nameTable);
+	memcpy(nameTable + n + 1, templateNames.data(), templateNames.size());
+
+	DictionaryHeader* header = (DictionaryHeader*)bytes;
+	header->magic = DICTIONARY_MAGIC;
+	header->version = DICTIONARY_VERSION;
+	header->count = (uint32_t)n;
+	header->variants = (uint32_t)m;
+	header->words = (uint32_t)w;
+	header->grid = GRID;
+	header->rotations = ROTATIONS;
+	header->sides = SIDES;
+	header->payloadBytes = payload;
+	header->checksum = fnv1a(bytes + sizeof(DictionaryHeader), payload);
+
+	return attach(bytes, sizeof(DictionaryHeader) + payload);
+}
+
+bool MarkerDictionary::loadCompiled(const string& file) {
+	void* view = 0;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(handle, &fileSize) && fileSize.QuadPart > 0) {
+		size = (size_t)fileSize.QuadPart;
+		HANDLE mapping = CreateFileMappingA(handle, 0, PAGE_READONLY, 0, 0, 0);
+		if (mapping) {
+			// the view keeps the mapping alive after the handles are closed
+			view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(handle);
+#else
+	int descriptor = ::open(file.c_str(), O_RDONLY);
+	if (descriptor < 0) return false;
+	struct stat status;
+	if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+		size = (size_t)status.st_size;
+		view = mmap(0, size, PROT_READ, MAP_SHARED, descriptor, 0);
+		if (view == MAP_FAILED) view = 0;
+	}
+	::close(descriptor);
+#endif
+	if (!view) return false;
+
+	mapped = view;
+	mappedSize = size;
+	if (attach(view, size)) return true;
+
+	cerr << "dictionary " << file << " is corrupt or has another version" << endl;
+	release();
+	return false;
+}
+
+// validates the layout in data and points the tables into it
+bool MarkerDictionary::attach(const void* layout, size_t size) {
+	if (size < sizeof(DictionaryHeader)) return false;
+	const DictionaryHeader* header = (const DictionaryHeader*)layout;
+	if (header->magic != DICTIONARY_MAGIC || header->version != DICTIONARY_VERSION ||
+		header->grid != GRID || header->rotations != ROTATIONS || header->sides != SIDES ||
+		header->count == 0 || header->variants == 0 || header->variants > header->count * SIDES * ROTATIONS ||
+		header->words != (header->variants + 63) / 64 ||
+		header->payloadBytes != size - sizeof(DictionaryHeader)) return false;
+
+	const unsigned char* payload = (const unsigned char*)layout + sizeof(DictionaryHeader);
+	size_t n = header->count, m = header->variants, w = header->words;
+	size_t tables = tableBytes(n, m, w);
+	if (tables > header->payloadBytes || fnv1a(payload, (size_t)header->payloadBytes) != header->checksum) return false;
+
+	const uint32_t* codeTable = (const uint32_t*)payload;
+	const uint32_t* variantTable = codeTable + n * SIDES * ROTATIONS;
+	for (size_t v = 0; v < m; v++) {
+		if (variantTable[v] >= n * SIDES * ROTATIONS) return false;
+	}
+	const uint32_t* offsets = (const uint32_t*)(payload + tables - (n + 1) * sizeof(uint32_t));
+	size_t nameBytes = header->payloadBytes - tables;
+	if (offsets[n] != nameBytes || (nameBytes > 0 && payload[tables + nameBytes - 1] != 0)) return false;
+	for (size_t i = 0; i < n; i++) {
+		if (offsets[i] > offsets[i + 1]) return false;
+	}
+
+	data = layout;
+	dataSize = size;
+	count = (int)n;
+	variantCount = (int)m;
+	words = (int)w;
+	codes = codeTable;
+	variantCodes = variantTable;
+	cellTemplates = (const uint64_t*)(variantTable + ((m + 1) & ~(size_t)1));
+	nameOffsets = offsets;
+	names = (const char*)(payload + tables);
+	return true;
+}
+
+bool MarkerDictionary::save(const string& file) const {
+	if (!data) return false;
+	std::ofstream out(file, std::ios::binary);
+	out.write((const char*)data, (std::streamsize)dataSize);
+	return (bool)out;
+}
+
+uint32_t MarkerDictionary::pack(const int markerMatrix[11][11]) {
+	uint32_t bright = 0;
+	for (int i = 0; i < GRID; i++) {
+		for (int j = 0; j < GRID; j++) {
+			if (markerMatrix[i + 3][j + 3] == 1) bright |= 1u << (i * GRID + j);
+		}
+	}
+	return bright;
+}
+
+uint32_t MarkerDictionary::rotate(uint32_t code) {
+	// cell (y, x) moves to (x, GRID - 1 - y)
+	uint32_t rotated = 0;
+	for (int y = 0; y < GRID; y++) {
+		for (int x = 0; x < GRID; x++) {
+			if (code & (1u << (y * GRID + x))) rotated |= 1u << (x * GRID + GRID - 1 - y);
+		}
+	}
+	return rotated;
+}
+
+uint32_t MarkerDictionary::mirror(uint32_t code) {
+	uint32_t mirrored = 0;
+	for (int y = 0; y < GRID; y++) {
+		for (int x = 0; x < GRID; x++) {
+			if (code & (1u << (y * GRID + x))) mirrored |= 1u << (y * GRID + GRID - 1 - x);
+		}
+	}
+	return mirrored;
+}
+
+// variants of one 64-wide word whose black cells are all dark in the marker
+uint64_t MarkerDictionary::matchingTemplates(uint32_t bright, size_t word) const
+{
+	uint64_t rejected = 0;
+	for (uint32_t cells = bright; cells != 0; cells &= cells - 1) {
+		rejected |= cellTemplates[lowestBit(cells) * words + word];
+	}
+	uint64_t valid = ~0ull;
+	size_t remaining = variantCount - word * 64;
+	if (remaining < 64) valid = (1ull << remaining) - 1;
+	return ~rejected & valid;
+}
+
+void MarkerDictionary::retrieve(uint32_t bright, vector<MarkerMatch>& matches) const {
+	matches.clear();
+	for (int w = 0; w < words; w++) {
+		for (uint64_t alive = matchingTemplates(bright, w); alive != 0; alive &= alive - 1) {
+			// variants are sorted by id: a repeated id can only follow its first match
+			int index = variantCodes[w * 64 + lowestBit(alive)];
+			int id = index / (SIDES * ROTATIONS);
+			if (!matches.empty() && matches.back().id == id) continue;
+			MarkerMatch match = { id, index % ROTATIONS, index / ROTATIONS % SIDES, 1.f };
+			matches.push_back(match);
+		}
+	}
+}
+
+bool MarkerDictionary::retrieveFirst(uint32_t bright, MarkerMatch& match) const {
+	for (int w = 0; w < words; w++) {
+		uint64_t alive = matchingTemplates(bright, w);
+		if (alive == 0) continue;
+		int index = variantCodes[w * 64 + lowestBit(alive)];
+		match.id = index / (SIDES * ROTATIONS);
+		match.rotation = index % ROTATIONS;
+		match.side = index / ROTATIONS % SIDES;
+		match.confidence = 1.f;
+		return true;
+	}
+	return false;
+}
+
+// a cell darker than this is explained by a template, a cell lighter than
+// PRUNE_DARKNESS rules out every variant that needs it black
+static const float DARK_CELL = 0.5f;
+static const float PRUNE_DARKNESS = 0.25f;
+
+StackedDecoder::StackedDecoder(const MarkerDictionary& dictionary)
+	: dictionary(dictionary), maxStack(4), nodeLimit(20000), nodes(0), templateCost(0.5f), dark(0), chosenCount(0), bestCount(0), bestCost(0) {
+}
+
+float StackedDecoder::decode(const float darkness[MarkerDictionary::CELLS], vector<MarkerMatch>& matches) {
+	const int CELLS = MarkerDictionary::CELLS;
+	matches.clear();
+	nodes = 0;
+
+	// every cell costs at least min(d, 1 - d) whatever the set: cover and
+	// skip are what covering it or leaving it unexplained add on top
+	float cost = 0;
+	uint32_t bright = 0;
+	dark = 0;
+	for (int c = 0; c < CELLS; c++) {
+		float d = darkness[c];
+		float lowest = std::min(d, 1 - d);
+		cost += lowest;
+		cover[c] = (1 - d) - lowest;
+		skip[c] = d - lowest;
+		if (d > DARK_CELL) dark |= 1u << c;
+		if (d < PRUNE_DARKNESS) bright |= 1u << c;
+	}
+
+	// one level per chosen template and per skipped cell
+	int words = dictionary.words;
+	alive.resize((size_t)(CELLS + MAX_STACK + 1) * words);
+	for (int w = 0; w < words; w++) alive[w] = dictionary.matchingTemplates(bright, w);
+
+	chosenCount = 0;
+	bestCount = 0;
+	bestCost = FLT_MAX;
+	search(0, 0, 0, cost);
+
+	// confidence: contrast between the cells only this template explains
+	// and the cells nothing explains
+	uint32_t covered = 0;
+	for (int k = 0; k < bestCount; k++) covered |= dictionary.codes[best[k]];
+	float background = 0;
+	int backgroundCells = 0;
+	for (int c = 0; c < CELLS; c++) {
+		if (covered & (1u << c)) continue;
+		background += darkness[c];
+		backgroundCells++;
+	}
+	if (backgroundCells) background /= backgroundCells;
+
+	for (int k = 0; k < bestCount; k++) {
+		uint32_t others = 0;
+		for (int j = 0; j < bestCount; j++) {
+			if (j != k) others |= dictionary.codes[best[j]];
+		}
+		float own = 0;
+		int ownCells = 0;
+		for (uint32_t cells = dictionary.codes[best[k]] & ~others; cells != 0; cells &= cells - 1) {
+			own += darkness[lowestBit(cells)];
+			ownCells++;
+		}
+		int index = best[k];
+		MarkerMatch match;
+		match.id = index / (MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS);
+		match.rotation = index % MarkerDictionary::ROTATIONS;
+		match.side = index / MarkerDictionary::ROTATIONS % MarkerDictionary::SIDES;
+		match.confidence = ownCells ? std::max(0.f, std::min(1.f, own / ownCells - background)) : 0.f;
+		matches.push_back(match);
+	}
+	std::sort(matches.begin(), matches.end(), [](const MarkerMatch& a, const MarkerMatch& b) { return a.id < b.id; });
+	return bestCost < FLT_MAX ? bestCost : cost;
+}
+
+void StackedDecoder::search(int level, uint32_t covered, uint32_t skipped, float cost) {
+	if (cost >= bestCost || ++nodes > nodeLimit) return;
+
+	uint32_t open = dark & ~covered & ~skipped;
+	if (open == 0) {
+		// the remaining cells cost their lower bound already
+		bestCost = cost;
+		bestCount = chosenCount;
+		std::copy(chosen, chosen + chosenCount, best);
+		return;
+	}
+
+	int words = dictionary.words;
+	const uint64_t* current = &alive[(size_t)level * words];
+	uint64_t* next = &alive[(size_t)(level + 1) * words];
+	const uint64_t* cellTemplates = dictionary.cellTemplates;
+
+	// branch on the open cell with the fewest variants that can cover it
+	int cell = -1, fewest = INT_MAX;
+	for (uint32_t cells = open; cells != 0; cells &= cells - 1) {
+		int c = lowestBit(cells), count = 0;
+		for (int w = 0; w < words; w++) count += popcount(current[w] & cellTemplates[c * words + w]);
+		if (count < fewest) {
+			fewest = count;
+			cell = c;
+		}
+	}
+
+	std::copy(current, current + words, next);
+	if (chosenCount < maxStack) {
+		for (int w = 0; w < words; w++) {
+			for (uint64_t candidates = current[w] & cellTemplates[cell * words + w]; candidates != 0; candidates &= candidates - 1) {
+				int bit = lowestBit(candidates);
+				int index = dictionary.variantCodes[w * 64 + bit];
+				int id = index / (MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS);
+
+				bool used = false;
+				for (int k = 0; k < chosenCount && !used; k++) {
+					used = chosen[k] / (MarkerDictionary::SIDES * MarkerDictionary::ROTATIONS) == id;
+				}
+				if (!used) {
+					uint32_t code = dictionary.codes[index];
+					float added = cost + templateCost;
+					for (uint32_t cells = code & ~covered; cells != 0; cells &= cells - 1) added += cover[lowestBit(cells)];
+
+					chosen[chosenCount++] = index;
+					search(level + 1, covered | code, skipped, added);
+					chosenCount--;
+				}
+				// the siblings after this one never choose it again
+				next[w] &= ~(1ull << bit);
+			}
+		}
+	}
+
+	// leave the cell unexplained: nothing covering it can join the set
+	for (int w = 0; w < words; w++) next[w] &= ~cellTemplates[cell * words + w];
+	search(level + 1, covered, skipped | (1u << cell), cost + skip[cell]);
+}
+
+double angle(Point pt1, Point pt2, Point pt0)
+{
+	double dx1 = pt1.x - pt0.x;
+	double dy1 = pt1.y - pt0.y;
+	double dx2 = pt2.x - pt0.x;
+	double dy2 = pt2.y - pt0.y;
+	return (dx1 * dx2 + dy1 * dy2) / sqrt((dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2) + 1e-10);
+}
+
+// homography from exactly four correspondences. findHomography with RANSAC
+// is overkill for four points and allocates on every call; here the 8x8 DLT
+// system is solved on the stack.
+bool quadHomography(const Point2f src[4], const Point2f dst[4], Matx33d& h)
+{
+	Matx88d a;
+	Matx81d b;
+	for (int i = 0; i < 4; i++) {
+		a(i, 0) = src[i].x;
+		a(i, 1) = src[i].y;
+		a(i, 2) = 1;
+		a(i, 6) = -src[i].x * dst[i].x;
+		a(i, 7) = -src[i].y * dst[i].x;
+		b(i) = dst[i].x;
+
+		a(i + 4, 3) = src[i].x;
+		a(i + 4, 4) = src[i].y;
+		a(i + 4, 5) = 1;
+		a(i + 4, 6) = -src[i].x * dst[i].y;
+		a(i + 4, 7) = -src[i].y * dst[i].y;
+		b(i + 4) = dst[i].y;
+	}
+	Matx81d x = a.solve(b, DECOMP_LU);
+	// Matx::solve returns zeros when the system is singular
+	if (norm(x, NORM_INF) == 0) return false;
+	h = Matx33d(x(0), x(1), x(2), x(3), x(4), x(5), x(6), x(7), 1);
+	return true;
+}
+
+// projective map of the unit square onto each quad (Heckbert), then scaled
+// to the square (s0, s0)-(s1, s1): a few dozen flops per quad against the
+// 8x8 solve and 3x3 inverse of quadHomography, in a loop the compiler can
+// vectorize
+template<>
+void squareToQuads<DoubleMath>(QuadBatch<DoubleMath>& batch, int s0, int s1)
+{
+	int n = batch.size();
+	const double *x0 = batch.x[0].data(), *x1 = batch.x[1].data(), *x2 = batch.x[2].data(), *x3 = batch.x[3].data();
+	const double *y0 = batch.y[0].data(), *y1 = batch.y[1].data(), *y2 = batch.y[2].data(), *y3 = batch.y[3].data();
+	double* m[9];
+	for (int k = 0; k < 9; k++) m[k] = batch.m[k].data();
+	unsigned char* valid = batch.valid.data();
+	double scale = 1.0 / (s1 - s0);
+
+	for (int i = 0; i < n; i++) {
+		double sx = x0[i] - x1[i] + x2[i] - x3[i], sy = y0[i] - y1[i] + y2[i] - y3[i];
+		double dx1 = x1[i] - x2[i], dx2 = x3[i] - x2[i];
+		double dy1 = y1[i] - y2[i], dy2 = y3[i] - y2[i];
+		double den = dx1 * dy2 - dx2 * dy1;
+		valid[i] = den != 0;
+		double inverse = 1 / (den != 0 ? den : 1);
+		double g = (sx * dy2 - dx2 * sy) * inverse;
+		double h = (dx1 * sy - sx * dy1) * inverse;
+		double a = x1[i] - x0[i] + g * x1[i], b = x3[i] - x0[i] + h * x3[i];
+		double d = y1[i] - y0[i] + g * y1[i], e = y3[i] - y0[i] + h * y3[i];
+
+		m[0][i] = a * scale;
+		m[1][i] = b * scale;
+		m[2][i] = x0[i] - s0 * scale * (a + b);
+		m[3][i] = d * scale;
+		m[4][i] = e * scale;
+		m[5][i] = y0[i] - s0 * scale * (d + e);
+		m[6][i] = g * scale;
+		m[7][i] = h * scale;
+		m[8][i] = 1 - s0 * scale * (g + h);
+	}
+}
+
+// the same map in integers, onto the quad moved so corner 0 is at the
+// origin (the translation would take most of the 32 bits). with integer
+// corners each coefficient of the double map times den * (s1 - s0) is then
+// an integer, exact in 64 bits for corners below 2^12; the nine are
+// shifted down together to 30 bits, which only quads of about 1000 pixels
+// need
+template<>
+void squareToQuads<FixedMath>(QuadBatch<FixedMath>& batch, int s0, int s1)
+{
+	int n = batch.size();
+	int64_t side = s1 - s0;
+	for (int i = 0; i < n; i++) {
+		int64_t x0 = batch.x[0][i], x1 = batch.x[1][i], x2 = batch.x[2][i], x3 = batch.x[3][i];
+		int64_t y0 = batch.y[0][i], y1 = batch.y[1][i], y2 = batch.y[2][i], y3 = batch.y[3][i];
+		int64_t sx = x0 - x1 + x2 - x3, sy = y0 - y1 + y2 - y3;
+		int64_t dx1 = x1 - x2, dx2 = x3 - x2;
+		int64_t dy1 = y1 - y2, dy2 = y3 - y2;
+		int64_t den = dx1 * dy2 - dx2 * dy1;
+		int64_t g = sx * dy2 - dx2 * sy;
+		int64_t h = dx1 * sy - sx * dy1;
+		int64_t a = (x1 - x0) * (den + g), b = (x3 - x0) * (den + h);
+		int64_t d = (y1 - y0) * (den + g), e = (y3 - y0) * (den + h);
+		int64_t m[9] = {
+			a, b, -s0 * (a + b),
+			d, e, -s0 * (d + e),
+			g, h, den * side - s0 * (g + h)
+		};
+
+		int64_t largest = 0;
+		for (int k = 0; k < 9; k++) largest = std::max(largest, m[k] < 0 ? -m[k] : m[k]);
+		int shift = 0;
+		while ((largest >> shift) >= ((int64_t)1 << 30)) shift++;
+		int64_t half = shift ? (int64_t)1 << (shift - 1) : 0;
+		for (int k = 0; k < 9; k++) batch.m[k][i] = (int32_t)((m[k] + half) >> shift);
+		batch.valid[i] = den != 0;
+	}
+}
+
+// orders the corners of a quad as top-left, top-right, bottom-right,
+// bottom-left. returns false when a quadrant has no corner.
+bool orderContour(const vector<Point>& contour, Point result[4]) {
+
+	int found = 0;
+
+	// integer centers (the sums were always divided as integers)
+	int xcenter = (contour[0].x + contour[1].x + contour[2].x + contour[3].x) / 4;
+	int ycenter = (contour[0].y + contour[1].y + contour[2].y + contour[3].y) / 4;
+
+	for (int i = 0; i < 4; i++) {
+		if (contour[i].x < xcenter && contour[i].y < ycenter) {
+			result[found++] = contour[i];
+			break;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		if (contour[i].x > xcenter && contour[i].y < ycenter) {
+			result[found++] = contour[i];
+			break;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		if (contour[i].x > xcenter && contour[i].y > ycenter) {
+			result[found++] = contour[i];
+			break;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		if (contour[i].x < xcenter && contour[i].y > ycenter) {
+			result[found++] = contour[i];
+			break;
+		}
+	}
+
+	return found == 4;
+}
+
+// fused front end of the detector: BGR -> gray -> threshold(64) -> boundary
+// map in a single pass over the frame, replacing cvtColor + threshold + Canny
+// and their intermediate images. bin gets exactly the values of
+// threshold(cvtColor(frame), 64) (same 14-bit gray weights); edges marks the
+// bright pixels that have a dark 4-neighbour, which is all findContours
+// needs from Canny on an image that is already binary. each edge row is
+// computed right after the bin row below it, while both are still in cache.
+static const int GRAY_B = 1868, GRAY_G = 9617, GRAY_R = 4899, GRAY_SHIFT = 14;
+// gray > 64  <=>  weighted sum + rounding >= 65 << 14
+static const unsigned GRAY_LIMIT = (65u << GRAY_SHIFT) - (1u << (GRAY_SHIFT - 1));
+
+static void binarizeRow(const unsigned char* src, unsigned char* dst, int cols, bool vectorized)
+{
+	int x = 0;
+#if CV_SIMD128
+	if (vectorized) {
+		v_uint16x8 wb = v_setall_u16(GRAY_B), wg = v_setall_u16(GRAY_G), wr = v_setall_u16(GRAY_R);
+		v_uint32x4 limit = v_setall_u32(GRAY_LIMIT - 1), bright = v_setall_u32(255);
+		for (; x <= cols - 16; x += 16) {
+			v_uint8x16 b, g, r;
+			v_load_deinterleave(src + x * 3, b, g, r);
+			v_uint16x8 b0, b1, g0, g1, r0, r1;
+			v_expand(b, b0, b1);
+			v_expand(g, g0, g1);
+			v_expand(r, r0, r1);
+
+			v_uint32x4 s[4], t0, t1;
+			v_mul_expand(b0, wb, s[0], s[1]);
+			v_mul_expand(g0, wg, t0, t1);
+			s[0] += t0;
+			s[1] += t1;
+			v_mul_expand(r0, wr, t0, t1);
+			s[0] += t0;
+			s[1] += t1;
+			v_mul_expand(b1, wb, s[2], s[3]);
+			v_mul_expand(g1, wg, t0, t1);
+			s[2] += t0;
+			s[3] += t1;
+			v_mul_expand(r1, wr, t0, t1);
+			s[2] += t0;
+			s[3] += t1;
+
+			// 0/255 per lane; 255 packs down to 8 bits without saturation
+			for (int k = 0; k < 4; k++) s[k] = (s[k] > limit) & bright;
+			v_store(dst + x, v_pack(v_pack(s[0], s[1]), v_pack(s[2], s[3])));
+		}
+	}
+#endif
+	for (; x < cols; x++) {
+		unsigned sum = src[x * 3] * GRAY_B + src[x * 3 + 1] * GRAY_G + src[x * 3 + 2] * GRAY_R;
+		dst[x] = sum >= GRAY_LIMIT ? 255 : 0;
+	}
+}
+
+// up/down are the rows above and below (the row itself at the image border)
+static void edgeRow(const unsigned char* up, const unsigned char* center, const unsigned char* down,
+	unsigned char* dst, int cols, bool vectorized)
+{
+	if (cols == 1) {
+		dst[0] = center[0] & ~(up[0] & down[0]);
+		return;
+	}
+	dst[0] = center[0] & ~(up[0] & down[0] & center[1]);
+	int x = 1;
+#if CV_SIMD128
+	if (vectorized) {
+		for (; x <= cols - 17; x += 16) {
+			v_uint8x16 c = v_load(center + x);
+			v_uint8x16 inner = v_load(up + x) & v_load(down + x) & v_load(center + x - 1) & v_load(center + x + 1);
+			v_store(dst + x, c & ~inner);
+		}
+	}
+#endif
+	for (; x < cols - 1; x++) {
+		dst[x] = center[x] & ~(up[x] & down[x] & center[x - 1] & center[x + 1]);
+	}
+	dst[cols - 1] = center[cols - 1] & ~(up[cols - 1] & down[cols - 1] & center[cols - 2]);
+}
+
+// the kernels are built for the baseline of CV_SIMD128, so this is an on/off
+// switch for them (useOptimized()), not a choice between instruction sets
+bool fusedKernelVectorized()
+{
+#if CV_SIMD128
+#if defined(__aarch64__) || defined(__ARM_NEON)
+	return useOptimized() && checkHardwareSupport(CV_CPU_NEON);
+#else
+	return useOptimized() && checkHardwareSupport(CV_CPU_SSE2);
+#endif
+#else
+	return false;
+#endif
+}
+
+void binarizeAndEdges(const Mat& frame, Mat& bin, Mat& edges, bool vectorized)
+{
+	CV_Assert(frame.type() == CV_8UC3);
+	bin.create(frame.size(), CV_8UC1);
+	edges.create(frame.size(), CV_8UC1);
+	int rows = frame.rows, cols = frame.cols;
+
+	for (int y = 0; y < rows; y++) {
+		binarizeRow(frame.ptr<unsigned char>(y), bin.ptr<unsigned char>(y), cols, vectorized);
+		if (y > 0) {
+			edgeRow(bin.ptr<unsigned char>(max(y - 2, 0)), bin.ptr<unsigned char>(y - 1), bin.ptr<unsigned char>(y),
+				edges.ptr<unsigned char>(y - 1), cols, vectorized);
+		}
+	}
+	if (rows > 0) {
+		edgeRow(bin.ptr<unsigned char>(max(rows - 2, 0)), bin.ptr<unsigned char>(rows - 1), bin.ptr<unsigned char>(rows - 1),
+			edges.ptr<unsigned char>(rows - 1), cols, vectorized);
+	}
+}
+
+// gray levels a pixel may fall below the window mean threshold and stay
+// bright: keeps sensor noise in flat dark areas from turning into edges
+static const int ADAPTIVE_MARGIN = 4;
+
+// adds (or subtracts) a row of gray levels to the window column sums
+static void addColumnRow(float* columns, const unsigned char* src, int cols, bool add, bool vectorized)
+{
+	int x = 0;
+#if CV_SIMD128
+	if (vectorized) {
+		for (; x <= cols - 16; x += 16) {
+			v_uint16x8 p0, p1;
+			v_expand(v_load(src + x), p0, p1);
+			v_uint32x4 q[4];
+			v_expand(p0, q[0], q[1]);
+			v_expand(p1, q[2], q[3]);
+			for (int k = 0; k < 4; k++) {
+				v_float32x4 value = v_cvt_f32(v_reinterpret_as_s32(q[k]));
+				v_float32x4 sum = v_load(columns + x + 4 * k);
+				v_store(columns + x + 4 * k, add ? sum + value : sum - value);
+			}
+		}
+	}
+#endif
+	if (add) for (; x < cols; x++) columns[x] += src[x];
+	else for (; x < cols; x++) columns[x] -= src[x];
+}
+
+// binary pixels [begin, end) of a row whose windows are all full:
+// prefix[x] is the sum of the first x column sums, inner the scale over
+// the window area. the SIMD lanes do the same float operations as the
+// scalar loop, so both give the same image.
+static void adaptiveRow(const unsigned char* src, const float* prefix, unsigned char* dst, int begin, int end, int radius,
+	float inner, int margin, bool vectorized)
+{
+	int x = begin;
+#if CV_SIMD128
+	if (vectorized) {
+		v_float32x4 factor = v_setall_f32(inner), offset = v_setall_f32((float)margin);
+		v_uint32x4 bright = v_setall_u32(255);
+		for (; x <= end - 16; x += 16) {
+			v_uint16x8 p0, p1;
+			v_expand(v_load(src + x), p0, p1);
+			v_uint32x4 s[4];
+			v_expand(p0, s[0], s[1]);
+			v_expand(p1, s[2], s[3]);
+			for (int k = 0; k < 4; k++) {
+				const float* window = prefix + x + 4 * k;
+				v_float32x4 threshold = (v_load(window + radius + 1) - v_load(window - radius)) * factor;
+				v_float32x4 value = v_cvt_f32(v_reinterpret_as_s32(s[k])) + offset;
+				s[k] = v_reinterpret_as_u32(value > threshold) & bright;
+			}
+			v_store(dst + x, v_pack(v_pack(s[0], s[1]), v_pack(s[2], s[3])));
+		}
+	}
+#endif
+	for (; x < end; x++) {
+		float threshold = (prefix[x + radius + 1] - prefix[x - radius]) * inner;
+		dst[x] = src[x] + margin > threshold ? 255 : 0;
+	}
+}
+
+void adaptiveBinarizeAndEdges(const Mat& gray, Mat& bin, Mat& edges, int radius, float contrast, int margin,
+	vector<float>& columnSums, bool vectorized)
+{
+	CV_Assert(gray.type() == CV_8UC1);
+	bin.create(gray.size(), CV_8UC1);
+	edges.create(gray.size(), CV_8UC1);
+	int rows = gray.rows, cols = gray.cols;
+	radius = max(1, radius);
+
+	// sums of the window rows per column (exact in float), then their
+	// prefix sums along the row, whose rounding stays far below a gray level
+	columnSums.resize(2 * (size_t)cols + 1);
+	float* columns = columnSums.data();
+	float* prefix = columns + cols;
+	std::fill(columns, columns + cols, 0.f);
+	for (int y = 0; y < min(radius, rows); y++) addColumnRow(columns, gray.ptr<unsigned char>(y), cols, true, vectorized);
+
+	float scale = 1 - contrast;
+	for (int y = 0; y < rows; y++) {
+		if (y + radius < rows) addColumnRow(columns, gray.ptr<unsigned char>(y + radius), cols, true, vectorized);
+		if (y - radius - 1 >= 0) addColumnRow(columns, gray.ptr<unsigned char>(y - radius - 1), cols, false, vectorized);
+		// a running sum: the only scalar loop left
+		prefix[0] = 0;
+		for (int x = 0; x < cols; x++) prefix[x + 1] = prefix[x] + columns[x];
+
+		int windowRows = min(rows, y + radius + 1) - max(0, y - radius);
+		const unsigned char* src = gray.ptr<unsigned char>(y);
+		unsigned char* dst = bin.ptr<unsigned char>(y);
+		// full windows in the middle of the row: one reciprocal, no clipping
+		int begin = min(radius, cols), end = max(begin, cols - radius);
+		float inner = scale / (float)(windowRows * (2 * radius + 1));
+		adaptiveRow(src, prefix, dst, begin, end, radius, inner, margin, vectorized);
+		for (int x = 0; x < cols; x++) {
+			if (x == begin) x = end;
+			if (x >= cols) break;
+			int x0 = max(0, x - radius), x1 = min(cols, x + radius + 1);
+			float threshold = (prefix[x1] - prefix[x0]) * scale / (float)(windowRows * (x1 - x0));
+			dst[x] = src[x] + margin > threshold ? 255 : 0;
+		}
+
+		if (y > 0) {
+			edgeRow(bin.ptr<unsigned char>(max(y - 2, 0)), bin.ptr<unsigned char>(y - 1), bin.ptr<unsigned char>(y),
+				edges.ptr<unsigned char>(y - 1), cols, vectorized);
+		}
+	}
+	if (rows > 0) {
+		edgeRow(bin.ptr<unsigned char>(max(rows - 2, 0)), bin.ptr<unsigned char>(rows - 1), bin.ptr<unsigned char>(rows - 1),
+			edges.ptr<unsigned char>(rows - 1), cols, vectorized);
+	}
+}
+
+int regionHulls(const Mat& gray, double minArea, vector<vector<Point> >& hulls, RegionHullScratch& scratch, Point offset)
+{
+	CV_Assert(gray.type() == CV_8UC1);
+	// regions are pixel sets, so their minimum area is below the quad limit:
+	// the bright ring of a marker covers only part of its quad
+	int minRegion = max(1, (int)(minArea * 0.3)), maxRegion = max(2, (int)(gray.total() / 2));
+	if (!scratch.mser) scratch.mser = MSER::create(5, minRegion, maxRegion, 0.5);
+	if (scratch.mser->getMinArea() != minRegion) scratch.mser->setMinArea(minRegion);
+	if (scratch.mser->getMaxArea() != maxRegion) scratch.mser->setMaxArea(maxRegion);
+	{
+		TM_OPENCV_CALL();
+		scratch.mser->detectRegions(gray, scratch.regions, scratch.boxes);
+	}
+
+	int count = 0;
+	for (size_t i = 0; i < scratch.regions.size(); i++) {
+		if (scratch.boxes[i].area() <= minArea) continue;
+		if ((int)hulls.size() <= count) hulls.resize(count + 1);
+		{
+			TM_OPENCV_CALL();
+			convexHull(scratch.regions[i], hulls[count]);
+		}
+		for (size_t k = 0; k < hulls[count].size(); k++) hulls[count][k] += offset;
+		count++;
+	}
+	return count;
+}
+
+// bilinear interpolation of warpPerspective at (X, Y) in 1/32 pixels
+static unsigned char interpolate(const Mat& image, int X, int Y)
+{
+	const int INTER_BITS = 5, INTER_TAB_SIZE = 1 << INTER_BITS;
+	const int COEF_BITS = 15;
+
+	int sx = X >> INTER_BITS, sy = Y >> INTER_BITS;
+	int ax = X & (INTER_TAB_SIZE - 1), ay = Y & (INTER_TAB_SIZE - 1);
+
+	// products of multiples of 1/32 are exact in 15 bits, so the weights
+	// need none of the rounding fix-ups of the OpenCV table
+	int weights[4] = {
+		(INTER_TAB_SIZE - ax) * (INTER_TAB_SIZE - ay) * 32, ax * (INTER_TAB_SIZE - ay) * 32,
+		(INTER_TAB_SIZE - ax) * ay * 32, ax * ay * 32
+	};
+
+	int sum = 0;
+	for (int k = 0; k < 4; k++) {
+		int px = sx + (k & 1), py = sy + (k >> 1);
+		if (px >= 0 && py >= 0 && px < image.cols && py < image.rows) {
+			sum += image.at<unsigned char>(py, px) * weights[k];
+		}
+	}
+	return saturate_cast<unsigned char>((sum + (1 << (COEF_BITS - 1))) >> COEF_BITS);
+}
+
+// fixed-point bilinear sampling of the 242x242 marker image at (x, y), without
+// computing the rest of it. m maps marker pixels to image pixels and the
+// arithmetic follows warpPerspective step by step (64-column blocks,
+// 1/32 pixel coordinates, 15-bit weights, zero border), so each sample is
+// the value the full warp would have written at that pixel.
+static unsigned char sampleWarped(const Mat& image, const Matx33d& m, int x, int y)
+{
+	const int INTER_TAB_SIZE = 32;
+
+	int block = x & ~63;
+	int offset = x - block;
+	double X0 = m(0, 0) * block + m(0, 1) * y + m(0, 2);
+	double Y0 = m(1, 0) * block + m(1, 1) * y + m(1, 2);
+	double W0 = m(2, 0) * block + m(2, 1) * y + m(2, 2);
+
+	double W = W0 + m(2, 0) * offset;
+	W = W ? INTER_TAB_SIZE / W : 0;
+	double fX = std::max((double)INT_MIN, std::min((double)INT_MAX, (X0 + m(0, 0) * offset) * W));
+	double fY = std::max((double)INT_MIN, std::min((double)INT_MAX, (Y0 + m(1, 0) * offset) * W));
+	return interpolate(image, saturate_cast<int>(fX), saturate_cast<int>(fY));
+}
+
+// a FixedMath marker map, see squareToQuads, and corner 0 of its quad
+struct FixedMap {
+	int32_t m[9];
+	int x0, y0;
+};
+
+// n / d rounded half to even, as cvRound
+static int64_t roundedQuotient(int64_t n, int64_t d)
+{
+	if (d < 0) {
+		n = -n;
+		d = -d;
+	}
+	int64_t q = n / d, r = n % d;
+	if (r < 0) {
+		q--;
+		r += d;
+	}
+	if (2 * r > d || (2 * r == d && (q & 1))) q++;
+	return q;
+}
+
+// sampleWarped with a FixedMath map: the 1/32 pixel position is the rounded
+// quotient of two 64-bit integers instead of a double product
+static unsigned char sampleWarped(const Mat& image, const FixedMap& map, int x, int y)
+{
+	const int32_t* m = map.m;
+	int64_t w = (int64_t)m[6] * x + (int64_t)m[7] * y + m[8];
+	if (!w) return interpolate(image, 0, 0);
+	int64_t X = 32 * map.x0 + roundedQuotient(32 * ((int64_t)m[0] * x + (int64_t)m[1] * y + m[2]), w);
+	int64_t Y = 32 * map.y0 + roundedQuotient(32 * ((int64_t)m[3] * x + (int64_t)m[4] * y + m[5]), w);
+	return interpolate(image, (int)std::max((int64_t)INT_MIN, std::min((int64_t)INT_MAX, X)),
+		(int)std::max((int64_t)INT_MIN, std::min((int64_t)INT_MAX, Y)));
+}
+
+// integer square root (floor)
+static uint32_t isqrt(uint64_t v)
+{
+	uint64_t root = 0, bit = (uint64_t)1 << 62;
+	while (bit > v) bit >>= 2;
+	while (bit) {
+		if (v >= root + bit) {
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else root >>= 1;
+		bit >>= 2;
+	}
+	return (uint32_t)root;
+}
+
+// the arithmetic findCandidates and decodeBatch use with each Math
+template<typename Math> struct Geometry;
+
+template<>
+struct Geometry<DoubleMath> {
+	typedef Matx33d Map;
+	typedef double Length;
+	struct Limits {
+		explicit Limits(double minArea) : area(minArea) {}
+		double area;
+	};
+
+	static bool smallBox(int area, const Limits& limits) { return area <= limits.area; }
+	static Length perimeter(const vector<Point>& contour) { return arcLength(contour, true); }
+	// no quad with perimeter p has an area above (p / 4)^2
+	static bool tooShort(Length perimeter, const Limits& limits) { return perimeter * perimeter <= 16 * limits.area; }
+	static double epsilon(Length perimeter) { return perimeter * 0.02; }
+	static bool areaAbove(const vector<Point>& quad, const Limits& limits) { return fabs(contourArea(quad)) > limits.area; }
+	// the cosines of three corners below 0.3
+	static bool squareCorners(const vector<Point>& quad) {
+		double maxCosine = 0;
+		for (int j = 2; j < 5; j++) maxCosine = std::max(maxCosine, fabs(angle(quad[j % 4], quad[j - 2], quad[j - 1])));
+		return maxCosine < 0.3;
+	}
+	static Map map(const QuadBatch<DoubleMath>& batch, int i) {
+		Map m;
+		for (int k = 0; k < 9; k++) m.val[k] = batch.m[k][i];
+		return m;
+	}
+};
+
+// lengths in 1/16 pixel (the floor per contour segment). the box and area
+// limits are the floors of the double ones, which integer values compare
+// with the same result; the perimeter runs short by under 1/16 pixel per
+// segment, so only contours right at the limit can go the other way
+template<>
+struct Geometry<FixedMath> {
+	typedef FixedMap Map;
+	typedef int64_t Length;
+	struct Limits {
+		explicit Limits(double minArea)
+			: box((int64_t)floor(minArea)), perimeter((int64_t)floor(16 * 256 * minArea)), doubleArea((int64_t)floor(2 * minArea)) {}
+		int64_t box, perimeter, doubleArea;
+	};
+
+	static bool smallBox(int area, const Limits& limits) { return area <= limits.box; }
+	static Length perimeter(const vector<Point>& contour) {
+		Length length = 0;
+		for (size_t i = 0, j = contour.size() - 1; i < contour.size(); j = i++) {
+			int64_t dx = contour[i].x - contour[j].x, dy = contour[i].y - contour[j].y;
+			length += isqrt(256 * (dx * dx + dy * dy));
+		}
+		return length;
+	}
+	static bool tooShort(Length perimeter, const Limits& limits) { return perimeter * perimeter <= limits.perimeter; }
+	// approxPolyDP takes its epsilon as a double
+	static double epsilon(Length perimeter) { return perimeter / 800.0; }
+	// shoelace, twice the area
+	static bool areaAbove(const vector<Point>& quad, const Limits& limits) {
+		int64_t area = 0;
+		for (int i = 0, j = 3; i < 4; j = i++) area += (int64_t)quad[j].x * quad[i].y - (int64_t)quad[i].x * quad[j].y;
+		return (area < 0 ? -area : area) > limits.doubleArea;
+	}
+	// |cos| < 0.3  <=>  100 dot^2 < 9 |a|^2 |b|^2, exact in 64 bits below 2^13
+	static bool squareCorners(const vector<Point>& quad) {
+		for (int j = 2; j < 5; j++) {
+			Point p1 = quad[j % 4], p2 = quad[j - 2], p0 = quad[j - 1];
+			int64_t dx1 = p1.x - p0.x, dy1 = p1.y - p0.y, dx2 = p2.x - p0.x, dy2 = p2.y - p0.y;
+			int64_t dot = dx1 * dx2 + dy1 * dy2;
+			if (100 * dot * dot >= 9 * (dx1 * dx1 + dy1 * dy1) * (dx2 * dx2 + dy2 * dy2)) return false;
+		}
+		return true;
+	}
+	static Map map(const QuadBatch<FixedMath>& batch, int i) {
+		Map m;
+		for (int k = 0; k < 9; k++) m.m[k] = batch.m[k][i];
+		m.x0 = batch.x[0][i];
+		m.y0 = batch.y[0][i];
+		return m;
+	}
+};
+
+// Otsu threshold of a histogram, same criterion as threshold(THRESH_OTSU)
+static int otsuThreshold(const int histogram[256], int total)
+{
+	double mu = 0, scale = 1. / total;
+	for (int i = 0; i < 256; i++) mu += i * (double)histogram[i];
+	mu *= scale;
+
+	double mu1 = 0, q1 = 0, maxSigma = 0;
+	int maxValue = 0;
+	for (int i = 0; i < 256; i++) {
+		double p = histogram[i] * scale;
+		mu1 *= q1;
+		q1 += p;
+		double q2 = 1. - q1;
+		if (std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1. - FLT_EPSILON) continue;
+		mu1 = (mu1 + i * p) / q1;
+		double mu2 = (mu - q1 * mu1) / q2;
+		double sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+		if (sigma > maxSigma) {
+			maxSigma = sigma;
+			maxValue = i;
+		}
+	}
+	return maxValue;
+}
+
+// sampleWarped with map m at the 11x11 cell centers of a marker (step 0) or
+// at the 3x3 patch of step pixels around each, in row order:
+// samples[cell * patch + k]
+template<typename Map>
+static void sampleCells(const Mat& image, const Map& m, int step, unsigned char* samples)
+{
+	for (int i = 0; i < 11; i++) {
+		for (int j = 0; j < 11; j++) {
+			if (!step) {
+				*samples++ = sampleWarped(image, m, 11 + 22 * j, 11 + 22 * i);
+				continue;
+			}
+			for (int dy = -step; dy <= step; dy += step) {
+				for (int dx = -step; dx <= step; dx += step) {
+					*samples++ = sampleWarped(image, m, 11 + 22 * j + dx, 11 + 22 * i + dy);
+				}
+			}
+		}
+	}
+}
+
+// cell matrix from the samples of sampleCells: the center of every cell
+// above 64 (fixed threshold) or, stacked, above the Otsu level of all the
+// patch samples (patch = 9)
+static void thresholdCells(const unsigned char* samples, int patch, bool stacked, int markerMatrix[11][11])
+{
+	int level = 64;
+	if (stacked) {
+		int histogram[256] = { 0 };
+		for (int k = 0; k < 11 * 11 * patch; k++) histogram[samples[k]]++;
+		level = otsuThreshold(histogram, 11 * 11 * patch);
+	}
+	for (int i = 0; i < 11; i++) {
+		for (int j = 0; j < 11; j++) {
+			markerMatrix[i][j] = samples[(i * 11 + j) * patch + patch / 2] > level ? 1 : 0;
+		}
+	}
+}
+
+// white border check and the bright inner cells of a cell matrix
+static bool packCode(const int markerMatrix[11][11], uint32_t& bright)
+{
+	for (int i = 2; i < 9; i++) {
+		if (markerMatrix[i][2] == 0 || markerMatrix[i][8] == 0 || markerMatrix[2][i] == 0 || markerMatrix[8][i] == 0) return false;
+	}
+	bright = MarkerDictionary::pack(markerMatrix);
+	return true;
+}
+
+// cell darkness for StackedDecoder from the mean level of the cells of
+// rings 1 to 9. ring 2 is the white border, ring 1 the dark surround the
+// contour was found against.
+static bool cellDarkness(const float levels[11][11], float darkness[MarkerDictionary::CELLS])
+{
+	float white = 0, black = 0;
+	for (int k = 0; k < 6; k++) {
+		white += levels[2][2 + k] + levels[2 + k][8] + levels[8][8 - k] + levels[8 - k][2];
+	}
+	for (int k = 0; k < 8; k++) {
+		black += levels[1][1 + k] + levels[1 + k][9] + levels[9][9 - k] + levels[9 - k][1];
+	}
+	white /= 24;
+	black /= 32;
+	if (white - black < 16) return false;
+
+	float scale = 1 / (white - black);
+	for (int k = 0; k < 6; k++) {
+		if ((white - levels[2][2 + k]) * scale > DARK_CELL || (white - levels[2 + k][8]) * scale > DARK_CELL ||
+			(white - levels[8][8 - k]) * scale > DARK_CELL || (white - levels[8 - k][2]) * scale > DARK_CELL) return false;
+	}
+
+	for (int i = 0; i < MarkerDictionary::GRID; i++) {
+		for (int j = 0; j < MarkerDictionary::GRID; j++) {
+			float d = (white - levels[i + 3][j + 3]) * scale;
+			darkness[i * MarkerDictionary::GRID + j] = std::max(0.f, std::min(1.f, d));
+		}
+	}
+	return true;
+}
+
+WorkStealingPool::WorkStealingPool(int threads) : generation(0), active(0), stopping(false), job(0), jobContext(0) {
+	threadCount = threads > 0 ? threads : max(1, (int)std::thread::hardware_concurrency());
+	ranges.reset(new WorkRange[threadCount]);
+	for (int t = 1; t < threadCount; t++) {
+		workers.push_back(std::thread(&WorkStealingPool::workerLoop, this, t));
+	}
+}
+
+WorkStealingPool::~WorkStealingPool() {
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		stopping = true;
+	}
+	jobReady.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+void WorkStealingPool::dispatch(int n, void (*function)(void*, int, int), void* context) {
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		for (int t = 0; t < threadCount; t++) {
+			std::lock_guard<std::mutex> rangeGuard(ranges[t].lock);
+			ranges[t].begin = (int)((int64_t)n * t / threadCount);
+			ranges[t].end = (int)((int64_t)n * (t + 1) / threadCount);
+		}
+		job = function;
+		jobContext = context;
+		active = threadCount - 1;
+		generation++;
+	}
+	jobReady.notify_all();
+
+	run(0);
+
+	std::unique_lock<std::mutex> lock(jobLock);
+	jobDone.wait(lock, [this] { return active == 0; });
+}
+
+void WorkStealingPool::workerLoop(int thread) {
+	int seen = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(jobLock);
+			jobReady.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+		}
+
+		run(thread);
+
+		std::lock_guard<std::mutex> guard(jobLock);
+		if (--active == 0) jobDone.notify_one();
+	}
+}
+
+void WorkStealingPool::run(int thread) {
+	int index;
+	while (next(thread, index)) job(jobContext, index, thread);
+}
+
+bool WorkStealingPool::next(int thread, int& index) {
+	{
+		std::lock_guard<std::mutex> guard(ranges[thread].lock);
+		if (ranges[thread].begin < ranges[thread].end) {
+			index = ranges[thread].begin++;
+			return true;
+		}
+	}
+
+	while (true) {
+		int victim = -1, largest = 0;
+		for (int t = 0; t < threadCount; t++) {
+			if (t == thread) continue;
+			std::lock_guard<std::mutex> guard(ranges[t].lock);
+			if (ranges[t].end - ranges[t].begin > largest) {
+				largest = ranges[t].end - ranges[t].begin;
+				victim = t;
+			}
+		}
+		if (victim < 0) return false;
+
+		int stolenBegin, stolenEnd;
+		{
+			std::lock_guard<std::mutex> guard(ranges[victim].lock);
+			int remaining = ranges[victim].end - ranges[victim].begin;
+			if (remaining <= 0) continue;
+			stolenEnd = ranges[victim].end;
+			stolenBegin = stolenEnd - (remaining + 1) / 2;
+			ranges[victim].end = stolenBegin;
+		}
+
+		// our range is empty, so nobody steals from it in between
+		std::lock_guard<std::mutex> guard(ranges[thread].lock);
+		ranges[thread].begin = stolenBegin + 1;
+		ranges[thread].end = stolenEnd;
+		index = stolenBegin;
+		return true;
+	}
+}
+
+static const char* STAGE_NAMES[STAGE_COUNT] = {
+	"detect", "binarize", "edges", "contours", "filter", "decode", "homography", "sample", "match", "refine", "overlay"
+};
+static const char* COUNTER_NAMES[COUNTER_COUNT] = {
+	"contours", "holes", "open", "small", "polygon", "angle", "candidates", "decodes", "decoded", "cached", "markers"
+};
+
+static std::atomic<uint64_t> profilerSerials(0);
+
+Profiler::Profiler(int window)
+	: serial(++profilerSerials), window(std::max(window, 1)), frames(0), tracing(false), recorded(0), maxEvents(0), origin(0) {
+	for (int s = 0; s < STAGE_COUNT; s++) stageTotals[s] = 0;
+	for (int c = 0; c < COUNTER_COUNT; c++) counterTotals[c] = 0;
+	stageHistory.assign((size_t)this->window * STAGE_COUNT, 0.f);
+	counterHistory.assign((size_t)this->window * COUNTER_COUNT, 0);
+}
+
+Profiler::~Profiler() {
+}
+
+const char* Profiler::stageName(TraceStage stage) {
+	return STAGE_NAMES[stage];
+}
+
+const char* Profiler::counterName(TraceCounter counter) {
+	return COUNTER_NAMES[counter];
+}
+
+int64_t Profiler::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the buffer of the calling thread. a thread can serve several profilers
+// (one per stream), so the last few are cached per thread.
+Profiler::ThreadBuffer* Profiler::threadBuffer() {
+	const int CACHED = 4;
+	thread_local uint64_t cachedSerials[CACHED] = { 0 };
+	thread_local ThreadBuffer* cached[CACHED] = { 0 };
+	thread_local int nextSlot = 0;
+	for (int k = 0; k < CACHED; k++) {
+		if (cachedSerials[k] == serial) return cached[k];
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	std::thread::id self = std::this_thread::get_id();
+	ThreadBuffer* buffer = 0;
+	for (size_t b = 0; b < buffers.size() && !buffer; b++) {
+		if (buffers[b]->owner == self) buffer = buffers[b].get();
+	}
+	if (!buffer) {
+		buffers.emplace_back(new ThreadBuffer());
+		buffer = buffers.back().get();
+		buffer->owner = self;
+		buffer->thread = (int)buffers.size();
+	}
+	cachedSerials[nextSlot] = serial;
+	cached[nextSlot] = buffer;
+	nextSlot = (nextSlot + 1) % CACHED;
+	return buffer;
+}
+
+void Profiler::record(int stage, int64_t begin, int64_t end) {
+	if (recorded++ >= maxEvents) return;
+	TraceEvent event = { begin, end, stage };
+	threadBuffer()->events.push_back(event);
+}
+
+void Profiler::add(TraceStage stage, int64_t begin, int64_t end) {
+	stageTotals[stage] += end - begin;
+	if (tracing) record(stage, begin, end);
+}
+
+void Profiler::endFrame() {
+	int slot = frames % window;
+	int64_t time = now();
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		stageHistory[(size_t)slot * STAGE_COUNT + s] = (float)(stageTotals[s].exchange(0) * 1e-6);
+	}
+	for (int c = 0; c < COUNTER_COUNT; c++) {
+		int value = counterTotals[c].exchange(0);
+		counterHistory[(size_t)slot * COUNTER_COUNT + c] = value;
+		if (tracing) record(-1 - c, time, value);
+	}
+	frames++;
+}
+
+ProfileSnapshot Profiler::snapshot() const {
+	ProfileSnapshot snapshot;
+	int n = std::min(frames, window);
+	snapshot.frames = n;
+
+	vector<float> times(n);
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		StageStats& stats = snapshot.stages[s];
+		stats.mean = stats.p95 = stats.max = 0;
+		if (n == 0) continue;
+		for (int f = 0; f < n; f++) times[f] = stageHistory[(size_t)f * STAGE_COUNT + s];
+		for (int f = 0; f < n; f++) {
+			stats.mean += times[f] / n;
+			stats.max = std::max(stats.max, (double)times[f]);
+		}
+		int rank = std::min(n - 1, (int)(0.95 * n));
+		std::nth_element(times.begin(), times.begin() + rank, times.end());
+		stats.p95 = times[rank];
+	}
+	for (int c = 0; c < COUNTER_COUNT; c++) {
+		double sum = 0;
+		for (int f = 0; f < n; f++) sum += counterHistory[(size_t)f * COUNTER_COUNT + c];
+		snapshot.counters[c] = n ? sum / n : 0;
+	}
+	return snapshot;
+}
+
+void Profiler::printSnapshot(FILE* out) const {
+	ProfileSnapshot stats = snapshot();
+	fprintf(out, "last %d frames, ms per frame:\n", stats.frames);
+	fprintf(out, "%-12s %8s %8s %8s\n", "stage", "mean", "p95", "max");
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		if (stats.stages[s].max == 0) continue;
+		fprintf(out, "%-12s %8.3f %8.3f %8.3f\n", STAGE_NAMES[s], stats.stages[s].mean, stats.stages[s].p95, stats.stages[s].max);
+	}
+	fprintf(out, "per frame:");
+	for (int c = 0; c < COUNTER_COUNT; c++) fprintf(out, " %s %.1f", COUNTER_NAMES[c], stats.counters[c]);
+	fprintf(out, "\n");
+}
+
+void Profiler::startTrace(size_t maxEvents) {
+	std::lock_guard<std::mutex> guard(lock);
+	for (size_t b = 0; b < buffers.size(); b++) buffers[b]->events.clear();
+	this->maxEvents = maxEvents;
+	recorded = 0;
+	origin = now();
+	tracing = true;
+}
+
+bool Profiler::writeTrace(const string& file) const {
+	ofstream out(file);
+	if (!out) return false;
+
+	// complete events for the stages, counter events per frame
+	std::lock_guard<std::mutex> guard(lock);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	char line[192];
+	for (size_t b = 0; b < buffers.size(); b++) {
+		const vector<TraceEvent>& events = buffers[b]->events;
+		for (size_t e = 0; e < events.size(); e++) {
+			const TraceEvent& event = events[e];
+			double ts = (event.begin - origin) * 1e-3;
+			if (event.stage >= 0) {
+				snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					first ? "" : ",\n", STAGE_NAMES[event.stage], buffers[b]->thread, ts, (event.end - event.begin) * 1e-3);
+			}
+			else {
+				snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+					first ? "" : ",\n", COUNTER_NAMES[-1 - event.stage], ts, (long long)event.end);
+			}
+			out << line;
+			first = false;
+		}
+	}
+	out << "]}\n";
+	return (bool)out;
+}
+
+MarkerDetector::MarkerDetector(const MarkerDictionary& dictionary, bool stacked)
+	: dictionary(dictionary), stacked(stacked), softStacking(true), stackDecoder(dictionary), frontEnd(FRONTEND_FUSED), decodeMode(DECODE_SAMPLE), batchDecoding(true), vectorized(fusedKernelVectorized()),
+	hierarchyFilter(true), cannyThreshold(50), adaptiveRadius(0), adaptiveContrast(0.15f), minArea(1000), contourCount(0), votes(0), calls(0), historyCount(0), profiler(0) {
+	contents.resize(1);
+	contents[0].create(242, 242, CV_8UC1);
+	objectPoints[0] = Point2f(44, 44);
+	objectPoints[1] = Point2f(241 - 44, 44);
+	objectPoints[2] = Point2f(241 - 44, 241 - 44);
+	objectPoints[3] = Point2f(44, 241 - 44);
+}
+
+void MarkerDetector::detect(const Mat& frame, vector<DetectedMarker>& markers) {
+	TM_SCOPE(profiler, STAGE_DETECT);
+	preprocess(frame);
+	findCandidates();
+	decodeCandidates(markers);
+}
+
+void MarkerDetector::detectRegion(const Mat& frame, const Rect& roi, vector<DetectedMarker>& markers) {
+	TM_SCOPE(profiler, STAGE_DETECT);
+	preprocess(frame, roi);
+	findCandidates();
+	decodeCandidates(markers);
+}
+
+void MarkerDetector::preprocess(const Mat& frame) {
+	preprocess(frame, Rect(0, 0, frame.cols, frame.rows));
+}
+
+void MarkerDetector::preprocess(const Mat& frame, const Rect& roi) {
+	// full-frame buffers with ROI views: no reallocation when the roi changes
+	gray.create(frame.size(), CV_8UC1);
+	bin.create(frame.size(), CV_8UC1);
+	edgeMap.create(frame.size(), CV_8UC1);
+	Mat grayRoi = gray(roi), binRoi = bin(roi), edgeRoi = edgeMap(roi);
+
+	if (frontEnd == FRONTEND_MSER) {
+		{
+			TM_SCOPE(profiler, STAGE_BINARIZE);
+			cvtColor(frame(roi), grayRoi, COLOR_BGR2GRAY);
+			threshold(grayRoi, binRoi, 64, 255, THRESH_BINARY);
+			edgeRoi.setTo(0);
+		}
+		TM_SCOPE(profiler, STAGE_CONTOURS);
+		contourCount = regionHulls(grayRoi, minArea, contours, regionScratch, roi.tl());
+		hierarchy.clear();
+		return;
+	}
+	if (frontEnd == FRONTEND_FUSED) {
+		TM_SCOPE(profiler, STAGE_BINARIZE);
+		binarizeAndEdges(frame(roi), binRoi, edgeRoi, vectorized);
+		// the soft decoder reads gray levels, not the binary image
+		if (softDecoding()) cvtColor(frame(roi), grayRoi, COLOR_BGR2GRAY);
+	}
+	else if (frontEnd == FRONTEND_ADAPTIVE) {
+		TM_SCOPE(profiler, STAGE_BINARIZE);
+		// the window follows the frame, not the roi, and its sums run over the
+		// roi padded by the radius (plus the pixel the edges look at), so a
+		// tracked region gets the binary and edge pixels of a full-frame pass
+		// default radius: a sixteenth of the height, a window of about an eighth
+		int radius = adaptiveRadius > 0 ? adaptiveRadius : max(4, frame.rows / 16);
+		Rect padded = Rect(roi.x - radius - 1, roi.y - radius - 1, roi.width + 2 * radius + 2, roi.height + 2 * radius + 2) &
+			Rect(0, 0, frame.cols, frame.rows);
+		Mat grayPadded = gray(padded);
+		cvtColor(frame(padded), grayPadded, COLOR_BGR2GRAY);
+		if (padded == roi) {
+			adaptiveBinarizeAndEdges(grayRoi, binRoi, edgeRoi, radius, adaptiveContrast, ADAPTIVE_MARGIN, columnSums, vectorized);
+		}
+		else {
+			// full-frame too, so the padded views keep their buffers
+			paddedBin.create(frame.size(), CV_8UC1);
+			paddedEdges.create(frame.size(), CV_8UC1);
+			Mat binPadded = paddedBin(padded), edgesPadded = paddedEdges(padded);
+			adaptiveBinarizeAndEdges(grayPadded, binPadded, edgesPadded, radius, adaptiveContrast, ADAPTIVE_MARGIN, columnSums, vectorized);
+			Rect inner(roi.x - padded.x, roi.y - padded.y, roi.width, roi.height);
+			binPadded(inner).copyTo(binRoi);
+			edgesPadded(inner).copyTo(edgeRoi);
+		}
+	}
+	else {
+		{
+			TM_SCOPE(profiler, STAGE_BINARIZE);
+			cvtColor(frame(roi), grayRoi, COLOR_BGR2GRAY);
+			threshold(grayRoi, binRoi, 64, 255, THRESH_BINARY);
+		}
+		TM_SCOPE(profiler, STAGE_EDGES);
+		TM_OPENCV_CALL();
+		Canny(binRoi, edgeRoi, 0, cannyThreshold, 5);
+	}
+	TM_SCOPE(profiler, STAGE_CONTOURS);
+	TM_OPENCV_CALL();
+	findContours(edgeRoi, contours, hierarchy, RETR_CCOMP, CHAIN_APPROX_SIMPLE, roi.tl());
+	contourCount = (int)contours.size();
+}
+
+template<typename Math>
+void MarkerDetector::findCandidates() {
+	typedef Geometry<Math> G;
+	TM_SCOPE(profiler, STAGE_FILTER);
+	typename G::Limits limits(minArea);
+	// region hulls are closed and have no hierarchy
+	bool tree = frontEnd != FRONTEND_MSER;
+	candidates.clear();
+	stats = CandidateStats();
+	stats.contours = contourCount;
+	for (int i = 0; i < contourCount; i++)
+	{
+		const vector<Point>& contour = contours[i];
+		if (hierarchyFilter) {
+			// every edge loop gives an outer contour and its hole (the
+			// level below in RETR_CCOMP) with the same quad: keep the outer one
+			if (tree && hierarchy[i][3] >= 0) {
+				stats.holes++;
+				continue;
+			}
+			// the border of a marker is a closed loop, so it has a hole
+			if (tree && hierarchy[i][2] < 0) {
+				stats.open++;
+				continue;
+			}
+			// the quad lies inside the bounding box, and no quad with perimeter
+			// p has an area above (p / 4)^2
+			if (contour.size() < 4) {
+				stats.small++;
+				continue;
+			}
+			Rect box = boundingRect(contour);
+			if (G::smallBox(box.area(), limits)) {
+				stats.small++;
+				continue;
+			}
+		}
+		typename G::Length perimeter = G::perimeter(contour);
+		if (hierarchyFilter && G::tooShort(perimeter, limits)) {
+			stats.small++;
+			continue;
+		}
+
+		stats.approximated++;
+		{
+			TM_OPENCV_CALL();
+			approxPolyDP(contour, approx, G::epsilon(perimeter), true);
+		}
+		if (approx.size() == 4 &&
+			G::areaAbove(approx, limits) &&
+			isContourConvex(approx))
+		{
+			MarkerQuad quad;
+			if (G::squareCorners(approx) && orderContour(approx, quad.corners)) {
+				candidates.push_back(quad);
+				stats.candidates++;
+			}
+			else stats.angle++;
+		}
+		else stats.polygon++;
+	}
+	TM_COUNT(profiler, COUNTER_CONTOURS, stats.contours);
+	TM_COUNT(profiler, COUNTER_HOLES, stats.holes);
+	TM_COUNT(profiler, COUNTER_OPEN, stats.open);
+	TM_COUNT(profiler, COUNTER_SMALL, stats.small);
+	TM_COUNT(profiler, COUNTER_POLYGON, stats.polygon);
+	TM_COUNT(profiler, COUNTER_ANGLE, stats.angle);
+	TM_COUNT(profiler, COUNTER_CANDIDATES, stats.candidates);
+}
+
+void MarkerDetector::setThreads(int threads) {
+	if (threads == 1) pool.reset();
+	else pool.reset(new WorkStealingPool(threads));
+
+	int count = pool ? pool->size() : 1;
+	contents.resize(count);
+	for (int t = 0; t < count; t++) contents[t].create(242, 242, CV_8UC1);
+}
+
+void MarkerDetector::copySettings(const MarkerDetector& other, int scale) {
+	stacked = other.stacked;
+	softStacking = other.softStacking;
+	frontEnd = other.frontEnd;
+	decodeMode = other.decodeMode;
+	batchDecoding = other.batchDecoding;
+	vectorized = other.vectorized;
+	hierarchyFilter = other.hierarchyFilter;
+	cannyThreshold = other.cannyThreshold;
+	adaptiveRadius = other.adaptiveRadius > 0 ? max(1, other.adaptiveRadius / max(1, scale)) : 0;
+	adaptiveContrast = other.adaptiveContrast;
+	minArea = other.minArea;
+}
+
+void MarkerDetector::setTemporalVoting(int votes) {
+	this->votes = std::max(0, std::min(MAX_VOTES, votes));
+	historyCount = 0;
+	voting = VotingStats();
+}
+
+// bright pixels of a binary image in a 4x4 grid over the bounding box of a
+// quad, on about 32x32 of its pixels; returns the pixels counted
+static int quadAppearance(const Mat& bin, const Point corners[4], uint16_t appearance[16])
+{
+	int x0 = corners[0].x, x1 = x0, y0 = corners[0].y, y1 = y0;
+	for (int c = 1; c < 4; c++) {
+		x0 = std::min(x0, corners[c].x);
+		x1 = std::max(x1, corners[c].x);
+		y0 = std::min(y0, corners[c].y);
+		y1 = std::max(y1, corners[c].y);
+	}
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::min(x1 + 1, bin.cols);
+	y1 = std::min(y1 + 1, bin.rows);
+	std::fill(appearance, appearance + 16, 0);
+	if (x1 <= x0 || y1 <= y0) return 0;
+
+	int width = x1 - x0, height = y1 - y0;
+	int stride = std::max(1, std::max(width, height) / 32);
+	int samples = 0;
+	for (int y = y0; y < y1; y += stride) {
+		const unsigned char* row = bin.ptr<unsigned char>(y);
+		uint16_t* cells = appearance + (y - y0) * 4 / height * 4;
+		for (int x = x0; x < x1; x += stride) {
+			cells[(x - x0) * 4 / width] += row[x] != 0;
+			samples++;
+		}
+	}
+	return samples;
+}
+
+// the templates (ids and sides) of a decode as one value; rotations and
+// confidences are left out, so a marker turning in the image keeps its key
+static uint64_t matchKey(const vector<MarkerMatch>& matches)
+{
+	uint32_t faces[64];
+	int count = (int)std::min(matches.size(), (size_t)64);
+	for (int k = 0; k < count; k++) faces[k] = (uint32_t)matches[k].id * 2 + matches[k].side;
+	std::sort(faces, faces + count);
+	return fnv1a((const unsigned char*)faces, count * sizeof(uint32_t));
+}
+
+// pairs every candidate with the closest unclaimed quad of the history
+// (centers within a quarter of the diagonal) and marks the ones that can
+// reuse its decode: corners within a pixel of the decoded ones, the same
+// bright pixels up to 3% of the box, a decode that agreed with the
+// reported templates and was made less than votes calls ago
+void MarkerDetector::matchHistory() {
+	calls++;
+	voting = VotingStats();
+	for (int h = 0; h < historyCount; h++) history[h].claimed = false;
+
+	uint16_t appearance[16];
+	for (size_t i = 0; i < candidates.size(); i++) {
+		CandidateCode& code = codes[i];
+		code.history = -1;
+		code.cached = false;
+		if (votes == 0) continue;
+
+		const Point* corners = candidates[i].corners;
+		Point2f center = (Point2f(corners[0]) + Point2f(corners[1]) + Point2f(corners[2]) + Point2f(corners[3])) * 0.25f;
+		double bestDistance = 0.25 * norm(corners[0] - corners[2]);
+		int best = -1;
+		for (int h = 0; h < historyCount; h++) {
+			if (history[h].claimed) continue;
+			const Point* seen = history[h].corners;
+			Point2f previous = (Point2f(seen[0]) + Point2f(seen[1]) + Point2f(seen[2]) + Point2f(seen[3])) * 0.25f;
+			double distance = norm(center - previous);
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = h;
+			}
+		}
+		if (best < 0) continue;
+
+		QuadHistory& entry = history[best];
+		entry.claimed = true;
+		entry.lastSeen = calls;
+		code.history = best;
+
+		bool still = entry.decodedKey == entry.reportedKey && entry.sinceDecode < votes;
+		for (int c = 0; c < 4 && still; c++) {
+			still = abs(corners[c].x - entry.decodedCorners[c].x) <= 1 && abs(corners[c].y - entry.decodedCorners[c].y) <= 1;
+		}
+		if (!still) continue;
+		int samples = quadAppearance(bin, corners, appearance);
+		int difference = 0;
+		for (int k = 0; k < 16; k++) difference += abs(appearance[k] - entry.appearance[k]);
+		if (samples == entry.appearanceSamples && difference * 32 <= samples) {
+			code.cached = true;
+			code.valid = true;
+			entry.sinceDecode++;
+			voting.cached++;
+		}
+	}
+}
+
+// records the result of candidate i in its history (starting one for a
+// quad that decoded) and returns the templates to report for it
+const vector<MarkerMatch>& MarkerDetector::vote(int i, const vector<MarkerMatch>& current) {
+	CandidateCode& code = codes[i];
+	if (code.history < 0) {
+		if (current.empty()) return current;
+		// a forgotten entry is reused with the capacity of its vectors
+		code.history = historyCount++;
+		if ((int)history.size() < historyCount) history.push_back(QuadHistory());
+		QuadHistory& entry = history[code.history];
+		entry.lastSeen = calls;
+		entry.claimed = true;
+		entry.voteCount = entry.voteHead = 0;
+	}
+
+	QuadHistory& entry = history[code.history];
+	const Point* corners = candidates[i].corners;
+	std::copy(corners, corners + 4, entry.corners);
+	uint64_t key = matchKey(current);
+	if (!code.cached) {
+		entry.decoded = current;
+		entry.decodedKey = key;
+		entry.sinceDecode = 0;
+		std::copy(corners, corners + 4, entry.decodedCorners);
+		entry.appearanceSamples = quadAppearance(bin, corners, entry.appearance);
+	}
+
+	entry.keys[entry.voteHead] = key;
+	entry.voteHead = (entry.voteHead + 1) % votes;
+	entry.voteCount = std::min(entry.voteCount + 1, votes);
+
+	int agreeing = 0;
+	for (int k = 0; k < entry.voteCount; k++) agreeing += entry.keys[k] == key;
+	// a new quad reports its first decode; the majority is of the votes
+	// recorded so far, so a quad seen for fewer than votes calls is not held
+	// back longer than a full window would hold it
+	if (entry.voteCount == 1 || key == entry.reportedKey || agreeing * 2 > entry.voteCount) {
+		entry.reported = current;
+		entry.reportedKey = key;
+	}
+	else voting.held++;
+	return entry.reported;
+}
+
+template<typename Math>
+void MarkerDetector::decodeCandidates(vector<DetectedMarker>& markers) {
+	TM_SCOPE(profiler, STAGE_DECODE);
+	markers.clear();
+	codes.resize(candidates.size());
+	matchHistory();
+
+	if (batchDecoding && decodeMode == DECODE_SAMPLE) decodeBatch<Math>();
+	else {
+		// homography and sampling run in parallel, each result in its own slot
+		auto body = [this](int i, int thread) {
+			if (codes[i].cached) return;
+			if (softDecoding()) codes[i].valid = readCellDarkness(gray, candidates[i].corners, codes[i].darkness, contents[thread]);
+			else codes[i].valid = decodeCode(bin, candidates[i].corners, codes[i].bright, contents[thread]);
+		};
+		if (pool) pool->parallelFor((int)candidates.size(), body);
+		else for (int i = 0; i < (int)candidates.size(); i++) body(i, 0);
+	}
+
+	int decoded = 0;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		if (codes[i].cached) matches = history[codes[i].history].decoded;
+		else if (!codes[i].valid) {
+			// a followed quad votes even when it did not decode
+			if (votes == 0) continue;
+			matches.clear();
+		}
+		else {
+			TM_SCOPE(profiler, STAGE_MATCH);
+			if (softDecoding()) stackDecoder.decode(codes[i].darkness, matches);
+			else retrieveMatches(codes[i].bright, matches);
+		}
+		decoded += !matches.empty();
+
+		const vector<MarkerMatch>& reported = votes > 0 ? vote((int)i, matches) : matches;
+		for (size_t k = 0; k < reported.size(); k++) {
+			DetectedMarker marker;
+			std::copy(candidates[i].corners, candidates[i].corners + 4, marker.corners);
+			marker.id = reported[k].id;
+			marker.rotation = reported[k].rotation;
+			marker.side = reported[k].side;
+			marker.stacked = (int)reported.size();
+			marker.confidence = reported[k].confidence;
+			markers.push_back(marker);
+		}
+	}
+
+	// quads not seen for votes calls are forgotten
+	if (votes > 0) {
+		int last = calls - votes;
+		historyCount = (int)(std::partition(history.begin(), history.begin() + historyCount,
+			[last](const QuadHistory& entry) { return entry.lastSeen > last; }) - history.begin());
+		voting.tracks = historyCount;
+	}
+	TM_COUNT(profiler, COUNTER_DECODES, (int)candidates.size() - voting.cached);
+	TM_COUNT(profiler, COUNTER_DECODED, decoded);
+	TM_COUNT(profiler, COUNTER_CACHED, voting.cached);
+	TM_COUNT(profiler, COUNTER_MARKERS, (int)markers.size());
+	(void)decoded;
+}
+
+template<> QuadBatch<DoubleMath>& MarkerDetector::quadBatch<DoubleMath>() { return batch; }
+template<> QuadBatch<FixedMath>& MarkerDetector::quadBatch<FixedMath>() { return fixedBatch; }
+
+// fills codes for every candidate: the maps of all quads in one
+// squareToQuads pass, then the cells of each candidate (in parallel) into
+// its block of cellSamples, and the code from the block
+template<typename Math>
+void MarkerDetector::decodeBatch() {
+	int n = (int)candidates.size();
+	QuadBatch<Math>& quads = quadBatch<Math>();
+	quads.resize(n);
+	{
+		TM_SCOPE(profiler, STAGE_HOMOGRAPHY);
+		for (int i = 0; i < n; i++) {
+			for (int k = 0; k < 4; k++) {
+				quads.x[k][i] = candidates[i].corners[k].x;
+				quads.y[k][i] = candidates[i].corners[k].y;
+			}
+		}
+		squareToQuads(quads, (int)objectPoints[0].x, (int)objectPoints[2].x);
+	}
+
+	// the same samples the per-candidate decoders read
+	bool soft = softDecoding();
+	int step = soft ? 5 : stacked ? 7 : 0;
+	int patch = step ? 9 : 1;
+	cellSamples.resize((size_t)n * 11 * 11 * patch);
+
+	auto body = [this, &quads, soft, step, patch](int i, int) {
+		if (codes[i].cached) return;
+		TM_SCOPE(profiler, STAGE_SAMPLE);
+		codes[i].valid = false;
+		if (!quads.valid[i]) return;
+		typename Geometry<Math>::Map m = Geometry<Math>::map(quads, i);
+		unsigned char* samples = &cellSamples[(size_t)i * 11 * 11 * patch];
+		sampleCells(soft ? gray : bin, m, step, samples);
+
+		if (soft) {
+			float levels[11][11];
+			for (int c = 0; c < 11 * 11; c++) {
+				int sum = 0;
+				for (int k = 0; k < 9; k++) sum += samples[c * 9 + k];
+				levels[c / 11][c % 11] = sum / 9.f;
+			}
+			codes[i].valid = cellDarkness(levels, codes[i].darkness);
+		}
+		else {
+			int markerMatrix[11][11];
+			thresholdCells(samples, patch, stacked, markerMatrix);
+			codes[i].valid = packCode(markerMatrix, codes[i].bright);
+		}
+	};
+	if (pool) pool->parallelFor(n, body);
+	else for (int i = 0; i < n; i++) body(i, 0);
+}
+
+template void MarkerDetector::findCandidates<DoubleMath>();
+template void MarkerDetector::findCandidates<FixedMath>();
+template void MarkerDetector::decodeCandidates<DoubleMath>(vector<DetectedMarker>& markers);
+template void MarkerDetector::decodeCandidates<FixedMath>(vector<DetectedMarker>& markers);
+
+bool MarkerDetector::readMarkerMatrix(const Mat& image, const Point corners[4], int markerMatrix[11][11], Mat& content) {
+	Point2f imagePoints[4];
+	for (int i = 0; i < 4; i++) imagePoints[i] = corners[i];
+
+	Matx33d h;
+	{
+		TM_SCOPE(profiler, STAGE_HOMOGRAPHY);
+		if (!quadHomography(imagePoints, objectPoints, h)) return false;
+	}
+	TM_SCOPE(profiler, STAGE_SAMPLE);
+
+	if (decodeMode == DECODE_WARP) {
+		{
+			TM_OPENCV_CALL();
+			warpPerspective(image, content, h, content.size());
+		}
+
+		if (stacked) threshold(content, content, 128, 255, THRESH_OTSU);
+
+		for (int i = 0; i < 11; i++) {
+			for (int j = 0; j < 11; j++) {
+				unsigned char value = content.at<unsigned char>(11 + 22 * i, 11 + 22 * j);
+				markerMatrix[i][j] = stacked ? value / 255 : (value > 64 ? 1 : 0);
+			}
+		}
+		return true;
+	}
+
+	// same inverse warpPerspective computes internally. stacked, the Otsu
+	// level comes from a 3x3 supersampled patch per cell instead of all
+	// 242x242 warped pixels
+	Matx33d inverse = h.inv(DECOMP_LU);
+	unsigned char samples[11 * 11 * 9];
+	sampleCells(image, inverse, stacked ? 7 : 0, samples);
+	thresholdCells(samples, stacked ? 9 : 1, stacked, markerMatrix);
+	return true;
+}
+
+bool MarkerDetector::readCellDarkness(const Mat& image, const Point corners[4], float darkness[MarkerDictionary::CELLS], Mat& content) {
+	Point2f imagePoints[4];
+	for (int i = 0; i < 4; i++) imagePoints[i] = corners[i];
+
+	Matx33d h;
+	{
+		TM_SCOPE(profiler, STAGE_HOMOGRAPHY);
+		if (!quadHomography(imagePoints, objectPoints, h)) return false;
+	}
+	TM_SCOPE(profiler, STAGE_SAMPLE);
+
+	Matx33d inverse;
+	if (decodeMode == DECODE_WARP) {
+		TM_OPENCV_CALL();
+		warpPerspective(image, content, h, content.size());
+	}
+	else inverse = h.inv(DECOMP_LU);
+
+	// mean of a 3x3 patch around every cell center of rings 1 to 9: the
+	// edges of a cell blend with its neighbours, its center does not
+	float levels[11][11];
+	for (int i = 1; i < 10; i++) {
+		for (int j = 1; j < 10; j++) {
+			int sum = 0;
+			for (int dy = -5; dy <= 5; dy += 5) {
+				for (int dx = -5; dx <= 5; dx += 5) {
+					int x = 11 + 22 * j + dx, y = 11 + 22 * i + dy;
+					sum += decodeMode == DECODE_WARP ? content.at<unsigned char>(y, x) : sampleWarped(image, inverse, x, y);
+				}
+			}
+			levels[i][j] = sum / 9.f;
+		}
+	}
+	return cellDarkness(levels, darkness);
+}
+
+bool MarkerDetector::decode(const Mat& image, const Point corners[4], vector<MarkerMatch>& matches) {
+	matches.clear();
+
+	if (softDecoding()) {
+		float darkness[MarkerDictionary::CELLS];
+		if (!readCellDarkness(image, corners, darkness, contents[0])) return false;
+		stackDecoder.decode(darkness, matches);
+		return true;
+	}
+
+	uint32_t bright;
+	if (!decodeCode(image, corners, bright, contents[0])) return false;
+
+	retrieveMatches(bright, matches);
+	return true;
+}
+
+bool MarkerDetector::decodeCode(const Mat& image, const Point corners[4], uint32_t& bright, Mat& content) {
+	int markerMatrix[11][11];
+	if (!readMarkerMatrix(image, corners, markerMatrix, content)) return false;
+	return packCode(markerMatrix, bright);
+}
+
+void MarkerDetector::retrieveMatches(uint32_t bright, vector<MarkerMatch>& matches) {
+	if (stacked) {
+		dictionary.retrieve(bright, matches);
+	}
+	else {
+		matches.clear();
+		MarkerMatch match;
+		if (dictionary.retrieveFirst(bright, match)) matches.push_back(match);
+	}
+}
+
+MarkerPoseEstimator::MarkerPoseEstimator() : subpixel(true), corner(1), imagePoints(4), profiler(0) {
+	setMarkerSize(1);
+}
+
+bool MarkerPoseEstimator::loadIntrinsics(const string& file) {
+	FileStorage storage(file, FileStorage::READ);
+	if (!storage.isOpened()) return false;
+	storage["camera_matrix"] >> cameraMatrix;
+	storage["distortion_coefficients"] >> distortion;
+	return !cameraMatrix.empty();
+}
+
+void MarkerPoseEstimator::setMarkerSize(double size) {
+	// corner order required by SOLVEPNP_IPPE_SQUARE, which is the detector
+	// order (top-left, top-right, bottom-right, bottom-left) with y up
+	float s = (float)size / 2;
+	markerSize = size;
+	objectPoints.clear();
+	objectPoints.push_back(Point3f(-s, s, 0));
+	objectPoints.push_back(Point3f(s, s, 0));
+	objectPoints.push_back(Point3f(s, -s, 0));
+	objectPoints.push_back(Point3f(-s, -s, 0));
+	previous.clear();
+}
+
+void MarkerPoseEstimator::refineCorners(const Mat& frame, const Point corners[4], Point2f refined[4]) {
+	for (int c = 0; c < 4; c++) refined[c] = Point2f((float)corners[c].x, (float)corners[c].y);
+	if (!subpixel) return;
+
+	// the border square is 7 cells wide: a window of half a cell sees the
+	// two border edges of the corner and nothing of the inner cells
+	double side = DBL_MAX;
+	for (int c = 0; c < 4; c++) side = min(side, norm(corners[c] - corners[(c + 1) % 4]));
+	int half = max(2, min(10, cvRound(side / 14)));
+
+	Rect frameRect(0, 0, frame.cols, frame.rows);
+	for (int c = 0; c < 4; c++) {
+		// only the pixels around the corner are converted to gray
+		Rect roi = Rect(corners[c].x - half - 2, corners[c].y - half - 2, 2 * half + 5, 2 * half + 5) & frameRect;
+		if (roi.area() == 0) continue;
+		if (frame.channels() == 3) cvtColor(frame(roi), patch, COLOR_BGR2GRAY);
+		else patch = frame(roi);
+
+		corner[0] = Point2f((float)(corners[c].x - roi.x), (float)(corners[c].y - roi.y));
+		cornerSubPix(patch, corner, Size(half, half), Size(-1, -1),
+			TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, 20, 0.01));
+
+		// a corner that ran off its window did not converge
+		Point2f moved = corner[0] + Point2f((float)roi.x, (float)roi.y);
+		if (norm(moved - refined[c]) <= half) refined[c] = moved;
+	}
+}
+
+static Point2f quadCenter(const Point2f corners[4]) {
+	return (corners[0] + corners[1] + corners[2] + corners[3]) * 0.25f;
+}
+
+// how far (pixels) the corner centroid of a marker may move between frames
+// for its previous pose to seed the solver
+static const float SEED_DISTANCE = 8;
+
+void MarkerPoseEstimator::estimate(const Mat& frame, const vector<DetectedMarker>& markers, vector<MarkerPose>& poses) {
+	TM_SCOPE(profiler, STAGE_REFINE);
+	static const Point2f unitSquare[4] = { Point2f(0, 0), Point2f(1, 0), Point2f(1, 1), Point2f(0, 1) };
+
+	poses.clear();
+	Point2f refined[4];
+	for (size_t i = 0; i < markers.size(); i++) {
+		const DetectedMarker& marker = markers[i];
+		bool sameQuad = i > 0 && std::equal(marker.corners, marker.corners + 4, markers[i - 1].corners);
+		if (!sameQuad) refineCorners(frame, marker.corners, refined);
+
+		// stacked markers share the corners but not the orientation
+		MarkerPose pose;
+		pose.id = marker.id;
+		pose.hasPose = false;
+		templateCorners(refined, marker.rotation, marker.side, pose.corners);
+		bool valid = quadHomography(unitSquare, pose.corners, pose.homography);
+		if (!valid) pose.homography = Matx33d::zeros();
+
+		if (valid && hasIntrinsics()) {
+			// the nearest pose of the same id: an id seen twice must not seed
+			// one marker with the pose of the other
+			const MarkerPose* last = 0;
+			Point2f center = quadCenter(pose.corners);
+			float nearest = SEED_DISTANCE;
+			for (size_t k = 0; k < previous.size(); k++) {
+				if (previous[k].id != pose.id || !previous[k].hasPose) continue;
+				float distance = (float)norm(quadCenter(previous[k].corners) - center);
+				if (distance <= nearest) {
+					nearest = distance;
+					last = &previous[k];
+				}
+			}
+			for (int c = 0; c < 4; c++) imagePoints[c] = pose.corners[c];
+			if (last) {
+				pose.rvec = last->rvec;
+				pose.tvec = last->tvec;
+				pose.hasPose = solvePnP(objectPoints, imagePoints, cameraMatrix, distortion, pose.rvec, pose.tvec, true, SOLVEPNP_ITERATIVE);
+			}
+			else {
+				pose.hasPose = solvePnP(objectPoints, imagePoints, cameraMatrix, distortion, pose.rvec, pose.tvec, false, SOLVEPNP_IPPE_SQUARE);
+			}
+		}
+		poses.push_back(pose);
+	}
+	previous = poses;
+}
+
+MarkerTracker::MarkerTracker(MarkerDetector& detector, int detectionInterval)
+	: detector(detector), detectionInterval(detectionInterval), sinceDetection(0), lost(false), detections(0), tracked(0) {
+}
+
+void MarkerTracker::startTracks(const vector<DetectedMarker>& markers) {
+	nextTracks.clear();
+	for (size_t i = 0; i < markers.size(); i++) {
+		// stacked markers share their quad: one track per quad
+		if (i > 0 && std::equal(markers[i].corners, markers[i].corners + 4, markers[i - 1].corners)) continue;
+
+		Track track;
+		track.id = markers[i].id;
+		for (int c = 0; c < 4; c++) {
+			track.corners[c] = markers[i].corners[c];
+			track.velocity[c] = Point2f(0, 0);
+		}
+
+		// keep the velocity of the same marker from the previous frames
+		Point2f center = quadCenter(track.corners);
+		for (size_t t = 0; t < tracks.size(); t++) {
+			if (tracks[t].id != track.id) continue;
+			Point2f previous = quadCenter(tracks[t].corners);
+			if (norm(center - previous) < 0.5 * norm(tracks[t].corners[0] - tracks[t].corners[2])) {
+				for (int c = 0; c < 4; c++) track.velocity[c] = track.corners[c] - tracks[t].corners[c];
+				break;
+			}
+		}
+		nextTracks.push_back(track);
+	}
+	tracks.swap(nextTracks);
+}
+
+void MarkerTracker::track(const Mat& frame, vector<DetectedMarker>& markers) {
+	if (tracks.empty() || lost || ++sinceDetection >= detectionInterval) {
+		detector.detect(frame, markers);
+		startTracks(markers);
+		sinceDetection = 0;
+		lost = false;
+		detections++;
+		return;
+	}
+
+	tracked++;
+	markers.clear();
+	nextTracks.clear();
+	Rect frameRect(0, 0, frame.cols, frame.rows);
+
+	for (size_t t = 0; t < tracks.size(); t++) {
+		Track track = tracks[t];
+		for (int c = 0; c < 4; c++) track.corners[c] += track.velocity[c];
+
+		// search window: predicted quad plus a quarter of its size
+		float minX = track.corners[0].x, maxX = minX, minY = track.corners[0].y, maxY = minY;
+		for (int c = 1; c < 4; c++) {
+			minX = min(minX, track.corners[c].x);
+			maxX = max(maxX, track.corners[c].x);
+			minY = min(minY, track.corners[c].y);
+			maxY = max(maxY, track.corners[c].y);
+		}
+		float margin = 0.25f * max(maxX - minX, maxY - minY) + 8;
+		Rect roi = Rect(Point(cvFloor(minX - margin), cvFloor(minY - margin)),
+			Point(cvCeil(maxX + margin), cvCeil(maxY + margin))) & frameRect;
+		if (roi.area() == 0) {
+			lost = true;
+			continue;
+		}
+
+		detector.detectRegion(frame, roi, found);
+
+		// the quad closest to the prediction that still carries the track id
+		Point2f predicted = quadCenter(track.corners);
+		int best = -1;
+		double bestDistance = margin;
+		for (size_t i = 0; i < found.size(); i++) {
+			if (found[i].id != track.id) continue;
+			Point2f corners[4];
+			for (int c = 0; c < 4; c++) corners[c] = found[i].corners[c];
+			double distance = norm(quadCenter(corners) - predicted);
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = (int)i;
+			}
+		}
+		if (best < 0) {
+			lost = true;
+			continue;
+		}
+
+		for (int c = 0; c < 4; c++) {
+			Point2f corner = found[best].corners[c];
+			track.velocity[c] = corner - tracks[t].corners[c];
+			track.corners[c] = corner;
+		}
+		nextTracks.push_back(track);
+
+		for (size_t i = 0; i < found.size(); i++) {
+			if (std::equal(found[i].corners, found[i].corners + 4, found[best].corners)) markers.push_back(found[i]);
+		}
+	}
+	tracks.swap(nextTracks);
+}
+
+PyramidDetector::PyramidDetector(MarkerDetector& detector, int levels, double coarseMinArea)
+	: detector(detector), coarse(detector.getDictionary()), levels(levels), coarseMinArea(coarseMinArea), pyramid(levels + 1),
+	coarseMs(0), refineMs(0) {
+}
+
+// boundingRect of the four corners of a quad, without building a contour
+static Rect quadBox(const Point corners[4]) {
+	int x0 = corners[0].x, x1 = x0, y0 = corners[0].y, y1 = y0;
+	for (int c = 1; c < 4; c++) {
+		x0 = std::min(x0, corners[c].x);
+		x1 = std::max(x1, corners[c].x);
+		y0 = std::min(y0, corners[c].y);
+		y1 = std::max(y1, corners[c].y);
+	}
+	return Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+void PyramidDetector::detect(const Mat& frame, vector<DetectedMarker>& markers) {
+	int64 t0 = getTickCount();
+
+	pyramid[0] = frame;
+	for (int l = 1; l <= levels; l++) {
+		TM_OPENCV_CALL();
+		pyrDown(pyramid[l - 1], pyramid[l]);
+	}
+	coarse.copySettings(detector, 1 << levels);
+	coarse.setMinArea(coarseMinArea);
+	coarse.preprocess(pyramid[levels]);
+	coarse.findCandidates();
+
+	int64 t1 = getTickCount();
+
+	markers.clear();
+	Rect frameRect(0, 0, frame.cols, frame.rows);
+	const vector<MarkerQuad>& quads = coarse.quads();
+	int scale = 1 << levels;
+
+	for (size_t q = 0; q < quads.size(); q++) {
+		Rect box = quadBox(quads[q].corners);
+		// one coarse pixel of slack on every side plus 10% of the quad
+		int margin = scale + max(box.width, box.height) * scale / 10;
+		Rect roi = Rect(box.x * scale - margin, box.y * scale - margin,
+			box.width * scale + 2 * margin, box.height * scale + 2 * margin) & frameRect;
+		if (roi.area() == 0) continue;
+
+		detector.detectRegion(frame, roi, found);
+
+		// neighbouring ROIs can find the same marker twice
+		for (size_t i = 0; i < found.size(); i++) {
+			bool duplicate = false;
+			for (size_t k = 0; k < markers.size() && !duplicate; k++) {
+				duplicate = markers[k].id == found[i].id &&
+					norm(markers[k].corners[0] - found[i].corners[0]) + norm(markers[k].corners[2] - found[i].corners[2]) < scale * 2;
+			}
+			if (!duplicate) markers.push_back(found[i]);
+		}
+	}
+
+	int64 t2 = getTickCount();
+	coarseMs = (t1 - t0) * 1000.0 / getTickFrequency();
+	refineMs = (t2 - t1) * 1000.0 / getTickFrequency();
+}
+
+
+static Point2f applyHomography(const Matx33d& h, Point2f p) {
+	double w = h(2, 0) * p.x + h(2, 1) * p.y + h(2, 2);
+	return Point2f((float)((h(0, 0) * p.x + h(0, 1) * p.y + h(0, 2)) / w), (float)((h(1, 0) * p.x + h(1, 1) * p.y + h(1, 2)) / w));
+}
+
+// smallest pyramid level side of an overlay texture
+static const int MIN_TEXTURE_LEVEL = 8;
+
+OverlayCompositor::OverlayCompositor() : roiOnly(true), mipmaps(true), warpedPixels(0) {
+}
+
+int OverlayCompositor::addTexture(const Mat& image) {
+	Texture texture;
+	texture.levels.push_back(image.clone());
+	texture.complete = false;
+	textures.push_back(texture);
+	return (int)textures.size() - 1;
+}
+
+// level index of the pyramid (built on the first call), or the coarsest one
+const Mat& OverlayCompositor::level(Texture& texture, int index) {
+	if (!texture.complete) {
+		while (texture.levels.back().cols >= 2 * MIN_TEXTURE_LEVEL && texture.levels.back().rows >= 2 * MIN_TEXTURE_LEVEL) {
+			Mat next;
+			pyrDown(texture.levels.back(), next);
+			texture.levels.push_back(next);
+		}
+		texture.complete = true;
+	}
+	return texture.levels[std::min(index, (int)texture.levels.size() - 1)];
+}
+
+bool OverlayCompositor::draw(Mat& target, int handle, const Matx33d& h) {
+	Texture& texture = textures[handle];
+	// a size, not a reference: level() may grow texture.levels
+	Size full = texture.levels[0].size();
+	Rect targetRect(0, 0, target.cols, target.rows);
+
+	Point2f corners[4] = { Point2f(0, 0), Point2f((float)full.width, 0), Point2f((float)full.width, (float)full.height), Point2f(0, (float)full.height) };
+	bool inFront = true;
+	Point2f landed[4];
+	for (int k = 0; k < 4; k++) {
+		double w = h(2, 0) * corners[k].x + h(2, 1) * corners[k].y + h(2, 2);
+		inFront = inFront && w > 0;
+		if (inFront) landed[k] = applyHomography(h, corners[k]);
+	}
+
+	// a corner behind the camera has no bounding box: warp everything
+	Rect box = targetRect;
+	if (roiOnly && inFront) {
+		float minX = landed[0].x, maxX = minX, minY = landed[0].y, maxY = minY;
+		for (int k = 1; k < 4; k++) {
+			minX = std::min(minX, landed[k].x);
+			maxX = std::max(maxX, landed[k].x);
+			minY = std::min(minY, landed[k].y);
+			maxY = std::max(maxY, landed[k].y);
+		}
+		// one pixel of slack for the bilinear fringe
+		box = Rect(Point(cvFloor(minX) - 1, cvFloor(minY) - 1), Point(cvCeil(maxX) + 2, cvCeil(maxY) + 2)) & targetRect;
+	}
+	if (box.area() == 0) return false;
+
+	// the level whose size is closest above the landed size
+	int index = 0;
+	if (mipmaps && roiOnly && inFront) {
+		double area = 0;
+		for (int k = 0; k < 4; k++) area += landed[k].x * landed[(k + 1) % 4].y - landed[(k + 1) % 4].x * landed[k].y;
+		double scale = sqrt(fabs(area) / 2 / ((double)full.width * full.height));
+		level(texture, 0);
+		while (scale < 0.5 && index + 1 < (int)texture.levels.size()) {
+			scale *= 2;
+			index++;
+		}
+	}
+	const Mat& source = index ? level(texture, index) : texture.levels[0];
+
+	// source pixels -> texture pixels -> target -> box
+	Matx33d toSource((double)full.width / source.cols, 0, 0, 0, (double)full.height / source.rows, 0, 0, 0, 1);
+	Matx33d toBox = Matx33d(1, 0, -box.x, 0, 1, -box.y, 0, 0, 1) * h * toSource;
+	Mat roi = target(box);
+	warpPerspective(source, roi, toBox, box.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+	warpedPixels += box.area();
+	return true;
+}
+
+// pixels per marker cell of the ink texture
+static const int SCENE_CELL = 16;
+
+SceneGenerator::SceneGenerator(const MarkerDictionary& dictionary, uint64_t seed) : dictionary(dictionary), rng(seed) {
+}
+
+// multiplies the light under the ink of one marker by 1 - absorption.
+// cellToImage maps marker cells (0..11, the white border from 2 to 9) to
+// the frame.
+void SceneGenerator::drawMarker(uint32_t code, const Matx33d& cellToImage, float absorption) {
+	const int GRID = MarkerDictionary::GRID;
+	ink.create(11 * SCENE_CELL, 11 * SCENE_CELL, CV_32F);
+	for (int i = 0; i < 11; i++) {
+		for (int j = 0; j < 11; j++) {
+			bool black = i < 2 || i > 8 || j < 2 || j > 8;
+			if (i >= 3 && i < 3 + GRID && j >= 3 && j < 3 + GRID) black = (code >> ((i - 3) * GRID + j - 3)) & 1;
+			ink(Rect(j * SCENE_CELL, i * SCENE_CELL, SCENE_CELL, SCENE_CELL)).setTo(Scalar(black ? 1 : 0));
+		}
+	}
+
+	Point2f outer[4] = { Point2f(0, 0), Point2f(11, 0), Point2f(11, 11), Point2f(0, 11) };
+	vector<Point> extent(4);
+	for (int k = 0; k < 4; k++) {
+		Point2f p = applyHomography(cellToImage, outer[k]);
+		extent[k] = Point(cvFloor(p.x), cvFloor(p.y));
+	}
+	Rect box = Rect(boundingRect(extent).tl(), boundingRect(extent).br() + Point(2, 2)) & Rect(0, 0, light.cols, light.rows);
+	if (box.area() == 0) return;
+
+	// texture pixels -> cells -> frame -> box
+	double scale = 1.0 / SCENE_CELL;
+	Matx33d toBox = Matx33d(1, 0, -box.x, 0, 1, -box.y, 0, 0, 1) * cellToImage * Matx33d(scale, 0, 0, 0, scale, 0, 0, 0, 1);
+	warpPerspective(ink, warped, toBox, box.size(), INTER_LINEAR, BORDER_CONSTANT, Scalar(0));
+
+	for (int y = 0; y < box.height; y++) {
+		float* row = light.ptr<float>(box.y + y) + box.x;
+		const float* coverage = warped.ptr<float>(y);
+		for (int x = 0; x < box.width; x++) row[x] *= 1 - absorption * coverage[x];
+	}
+}
+
+void SceneGenerator::generate(const SceneOptions& options, Mat& frame, vector<SceneMarker>& truth) {
+	truth.clear();
+	boxes.clear();
+	Size size = options.size;
+	Rect frameRect(0, 0, size.width, size.height);
+
+	// lighting: a base level with a linear gradient across the frame
+	float base = (float)rng.uniform(options.minLight, options.maxLight);
+	float gx = (float)rng.uniform(-options.lightingGradient, options.lightingGradient);
+	float gy = (float)rng.uniform(-options.lightingGradient, options.lightingGradient);
+	light.create(size, CV_32F);
+	for (int y = 0; y < size.height; y++) {
+		float* row = light.ptr<float>(y);
+		for (int x = 0; x < size.width; x++) {
+			row[x] = base * (1 + gx * ((float)x / size.width - 0.5f) + gy * ((float)y / size.height - 0.5f));
+		}
+	}
+
+	// quads first, so the clutter can stay out of them
+	static const Point2f borderCells[4] = { Point2f(2, 2), Point2f(9, 2), Point2f(9, 9), Point2f(2, 9) };
+	vector<Matx33d> quads;
+	for (int q = 0; q < options.markers; q++) {
+		for (int attempt = 0; attempt < 50; attempt++) {
+			double side = rng.uniform(options.minSide, options.maxSide);
+			double half = side / 2, reach = half * 11 / 7 * 1.5;
+			if (2 * reach >= size.width || 2 * reach >= size.height) continue;
+			Point2f center((float)rng.uniform(reach, size.width - reach), (float)rng.uniform(reach, size.height - reach));
+			double theta = rng.uniform(-options.maxRotation, options.maxRotation) * CV_PI / 180;
+			double c = cos(theta), s = sin(theta), jitter = options.maxTilt * side;
+
+			Point2f corners[4];
+			for (int k = 0; k < 4; k++) {
+				double x = (k == 1 || k == 2) ? half : -half, y = k >= 2 ? half : -half;
+				corners[k] = center + Point2f((float)(c * x - s * y + rng.uniform(-jitter, jitter)),
+					(float)(s * x + c * y + rng.uniform(-jitter, jitter)));
+			}
+			Matx33d h;
+			if (!quadHomography(borderCells, corners, h)) continue;
+
+			vector<Point> extent;
+			for (int k = 0; k < 4; k++) {
+				Point2f p = applyHomography(h, Point2f((float)(k == 1 || k == 2) * 11, (float)(k >= 2) * 11));
+				extent.push_back(Point(cvRound(p.x), cvRound(p.y)));
+			}
+			Rect box = boundingRect(extent);
+			box = Rect(box.x - 4, box.y - 4, box.width + 8, box.height + 8);
+			if ((box & frameRect) != box) continue;
+			bool overlaps = false;
+			for (size_t b = 0; b < boxes.size() && !overlaps; b++) overlaps = (box & boxes[b]).area() > 0;
+			if (overlaps) continue;
+
+			boxes.push_back(box);
+			quads.push_back(h);
+			break;
+		}
+	}
+
+	for (int k = 0; k < options.clutter; k++) {
+		float value = base * (float)rng.uniform(0.05, 1.1);
+		int kind = rng.uniform(0, 3);
+		Point a(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		Rect extent;
+		if (kind == 0) extent = Rect(a, Size(rng.uniform(8, size.width / 6 + 9), rng.uniform(8, size.height / 6 + 9)));
+		else if (kind == 1) {
+			int radius = rng.uniform(4, size.height / 10 + 5);
+			extent = Rect(a.x - radius, a.y - radius, 2 * radius + 1, 2 * radius + 1);
+		}
+		else extent = Rect(a, Point(rng.uniform(0, size.width), rng.uniform(0, size.height)));
+
+		bool overlaps = false;
+		for (size_t b = 0; b < boxes.size() && !overlaps; b++) overlaps = (extent & boxes[b]).area() > 0;
+		if (overlaps) continue;
+
+		if (kind == 0) rectangle(light, extent, Scalar(value), -1);
+		else if (kind == 1) circle(light, Point(extent.x + extent.width / 2, extent.y + extent.height / 2), extent.width / 2, Scalar(value), -1);
+		else line(light, extent.tl(), extent.br(), Scalar(value), rng.uniform(1, 5));
+	}
+
+	for (size_t q = 0; q < quads.size(); q++) {
+		int stack = std::min(rng.uniform(1, options.maxStack + 1), dictionary.size());
+		int side = rng.uniform(0., 1.) < options.backProbability ? 1 : 0;
+		size_t first = truth.size();
+		while ((int)(truth.size() - first) < stack) {
+			SceneMarker marker;
+			marker.id = rng.uniform(0, dictionary.size());
+			bool repeated = false;
+			for (size_t k = first; k < truth.size(); k++) repeated = repeated || truth[k].id == marker.id;
+			if (repeated) continue;
+
+			marker.rotation = rng.uniform(0, MarkerDictionary::ROTATIONS);
+			marker.side = side;
+			marker.stacked = stack;
+			for (int k = 0; k < 4; k++) marker.corners[k] = applyHomography(quads[q], borderCells[k]);
+			drawMarker(dictionary.code(marker.id, marker.rotation, marker.side), quads[q], (float)rng.uniform(0.8, 0.95));
+			truth.push_back(marker);
+		}
+	}
+
+	// a slight color cast, optical blur, then sensor noise
+	float tint[3];
+	for (int c = 0; c < 3; c++) tint[c] = (float)rng.uniform(0.9, 1.1);
+	color.create(size, CV_32FC3);
+	for (int y = 0; y < size.height; y++) {
+		const float* row = light.ptr<float>(y);
+		float* out = color.ptr<float>(y);
+		for (int x = 0; x < size.width; x++) {
+			for (int c = 0; c < 3; c++) out[3 * x + c] = row[x] * tint[c];
+		}
+	}
+	if (options.blur > 0) GaussianBlur(color, color, Size(0, 0), options.blur);
+	if (options.noise > 0) {
+		noise.create(size, CV_32FC3);
+		rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(options.noise));
+		add(color, noise, color);
+	}
+	color.convertTo(frame, CV_8UC3);
+}
+}
@@ -0,0 +1,942 @@
+// Transparent marker detection library. Everything the detector needs
+// lives in the objects below (no globals), so several detectors can run
+// side by side, each on its own thread, sharing one MarkerDictionary.
+#ifndef TRANSPARENT_MARKERS_HPP
+#define TRANSPARENT_MARKERS_HPP
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/features2d/features2d.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace transparent {
+
+// one template found in a marker: rotation is the number of 90 degree
+// clockwise turns of the template in the image, side is 1 when the
+// (transparent) marker is seen from the back, i.e. mirrored. confidence
+// is in [0, 1]; hard (thresholded) decoders always give 1.
+struct MarkerMatch {
+	int id;
+	int rotation;
+	int side;
+	float confidence;
+};
+
+// the marker content is the 5x5 inner grid of the 11x11 marker (cells 3..7).
+// each template is packed into one word with bit (y*5+x) set for every
+// black cell. the four rotations of a template, seen from the front and
+// from the back, are precomputed as variants, and for every cell a bitset
+// of the variants that need that cell black is kept. a lookup is then a
+// few ORs per 64 variants and gives id, rotation and side at once.
+//
+// template images that are a rotation or mirror of an earlier one (in
+// file name order) are folded into its id, so a directory holding every
+// orientation of a marker yields one id per marker.
+//
+// the tables have one binary layout, built in memory from a directory of
+// template images or compiled offline by save() and mapped read-only by
+// load(), so every process on a host shares the same pages. template ids
+// follow the sorted file names, whatever the filesystem order. the
+// dictionary is read-only once loaded and can be shared by any number of
+// detectors; it cannot be copied.
+class MarkerDictionary {
+public:
+	static const int GRID = 5;
+	static const int CELLS = GRID * GRID;
+	static const int ROTATIONS = 4;
+	static const int SIDES = 2;
+
+	MarkerDictionary();
+	~MarkerDictionary();
+	MarkerDictionary(const MarkerDictionary&) = delete;
+	MarkerDictionary& operator=(const MarkerDictionary&) = delete;
+
+	// loads a directory of template images (black pixels are the black
+	// cells) or a file written by save(). returns false if nothing usable
+	// was found, or if the file has a wrong version, size or checksum.
+	bool load(const std::string& path);
+
+	// writes the versioned, checksummed binary dictionary
+	bool save(const std::string& file) const;
+
+	// number of ids
+	int size() const { return count; }
+	// number of distinct variants the matcher tests (8 per id at most)
+	int variants() const { return variantCount; }
+	// file name of template id
+	const char* name(int id) const { return names + nameOffsets[id]; }
+	// black cells of template id turned rotation * 90 degrees clockwise,
+	// mirrored first for side 1
+	uint32_t code(int id, int rotation = 0, int side = 0) const { return codes[(id * SIDES + side) * ROTATIONS + rotation]; }
+	// true when the tables are mapped from a compiled file
+	bool isMapped() const { return mapped != 0; }
+
+	// packs the bright (1) cells of the inner grid into a template-compatible word
+	static uint32_t pack(const int markerMatrix[11][11]);
+	// turns a packed grid 90 degrees clockwise
+	static uint32_t rotate(uint32_t code);
+	// mirrors a packed grid left to right
+	static uint32_t mirror(uint32_t code);
+	// black cells of a template image, packed as by code(); false if the
+	// file is not an image
+	static bool readTemplate(const std::string& file, uint32_t& code);
+
+	// matches is cleared and filled with every id that has a variant whose
+	// black cells are all dark in bright, in id order, one match per id
+	// (its first matching variant)
+	void retrieve(uint32_t bright, std::vector<MarkerMatch>& matches) const;
+	// same as retrieve but stops at the first (lowest id) match; false if none
+	bool retrieveFirst(uint32_t bright, MarkerMatch& match) const;
+
+private:
+	bool loadDirectory(const std::string& directory);
+	bool loadCompiled(const std::string& file);
+	bool attach(const void* data, size_t size);
+	void release();
+	uint64_t matchingTemplates(uint32_t bright, size_t word) const;
+
+	friend class StackedDecoder;
+
+	std::vector<uint64_t> owned; // layout built from a directory
+	void* mapped;                // or mapped from a compiled file
+	size_t mappedSize;
+	const void* data;
+	size_t dataSize;
+
+	int count, variantCount, words;
+	const uint32_t* codes;         // [count][SIDES][ROTATIONS]
+	const uint32_t* variantCodes;  // [variantCount] index into codes
+	const uint64_t* cellTemplates; // [CELLS][words]
+	const uint32_t* nameOffsets;   // [count + 1]
+	const char* names;
+};
+
+// decoder of stacked markers from soft cell levels. darkness[y * 5 + x] is
+// the darkness of an inner cell in [0, 1] (0 = the white border, 1 = the
+// black surround); a stack shows the union of the black cells of its
+// templates. decode() searches for the set of templates, one variant per
+// id, that minimizes
+//
+//   templateCost * |set| + sum over covered cells (1 - darkness)
+//                        + sum over the other cells darkness
+//
+// so a template that adds nothing to the cells already explained costs
+// more than it gains, and supersets of the true stack are never kept.
+// the search is a branch and bound over the dark cells, most constrained
+// cell first, that either covers the cell with one of the variants of the
+// dictionary cell bitset or leaves it unexplained. variants needing a
+// clearly bright cell are pruned up front with the same bitsets, and a
+// cell left unexplained removes every variant covering it.
+//
+// the confidence of a decoded id is the darkness contrast between the
+// cells only that template explains and the cells no template explains.
+// one decoder must not be used by two threads at once.
+class StackedDecoder {
+public:
+	// deepest stack the decoder can return
+	static const int MAX_STACK = 8;
+
+	explicit StackedDecoder(const MarkerDictionary& dictionary);
+
+	// deepest stack searched (default 4, at most MAX_STACK)
+	void setMaxStack(int depth) { maxStack = std::max(1, std::min(depth, (int)MAX_STACK)); }
+	// cost of one more template, in cells of mismatch (default 0.5)
+	void setTemplateCost(float cost) { templateCost = cost; }
+	// search nodes visited before the best set so far is returned (default 20000)
+	void setNodeLimit(int limit) { nodeLimit = limit; }
+
+	// matches is cleared and filled with the best explanation of darkness,
+	// in id order; returns its cost
+	float decode(const float darkness[MarkerDictionary::CELLS], std::vector<MarkerMatch>& matches);
+
+	// search nodes visited by the last decode()
+	int visitedNodes() const { return nodes; }
+
+private:
+	void search(int level, uint32_t covered, uint32_t skipped, float cost);
+
+	const MarkerDictionary& dictionary;
+	int maxStack, nodeLimit, nodes;
+	float templateCost;
+	float cover[MarkerDictionary::CELLS], skip[MarkerDictionary::CELLS];
+	uint32_t dark;
+	std::vector<uint64_t> alive; // [level][words]
+	int chosen[MAX_STACK], chosenCount;
+	int best[MAX_STACK], bestCount;
+	float bestCost;
+};
+
+// finds a cosine of angle between vectors from pt0->pt1 and from pt0->pt2
+double angle(cv::Point pt1, cv::Point pt2, cv::Point pt0);
+
+// homography from exactly four correspondences (8x8 DLT on the stack);
+// returns false for a degenerate quad
+bool quadHomography(const cv::Point2f src[4], const cv::Point2f dst[4], cv::Matx33d& h);
+
+// arithmetic of the candidate filter and of the batched decoder, chosen at
+// compile time. DoubleMath is the reference. FixedMath stays in integers:
+// squared cosines without sqrt, 64-bit shoelace areas, an integer square
+// root per contour segment for the perimeter, and exact integer marker
+// maps rounded to int32 coefficients, so the sample positions are found
+// without floating point.
+struct DoubleMath {
+	typedef double Coefficient;
+};
+struct FixedMath {
+	typedef int32_t Coefficient;
+};
+
+// arithmetic of MarkerDetector::detect(): FixedMath with TM_FIXED_POINT
+// (TRANSPARENT_FIXED_POINT in CMake), DoubleMath otherwise
+#ifdef TM_FIXED_POINT
+typedef FixedMath DetectorMath;
+#else
+typedef DoubleMath DetectorMath;
+#endif
+
+// quads in structure-of-arrays layout: corner k of quad i is (x[k][i],
+// y[k][i]). squareToQuads fills m[0..8][i] with the row-major map from the
+// square (s0, s0)-(s1, s1) onto quad i, corners in the order of
+// orderContour, closed form and branch-free over all quads at once;
+// valid[i] is 0 for a degenerate quad. FixedMath maps go onto the quad
+// moved so corner 0 is at the origin, scaled so their largest coefficient
+// has at most 30 bits.
+template<typename Math>
+struct QuadBatch {
+	typedef typename Math::Coefficient Coefficient;
+	std::vector<Coefficient> x[4], y[4];
+	std::vector<Coefficient> m[9];
+	std::vector<unsigned char> valid;
+
+	int size() const { return (int)valid.size(); }
+	void resize(int n) {
+		for (int k = 0; k < 4; k++) {
+			x[k].resize(n);
+			y[k].resize(n);
+		}
+		for (int k = 0; k < 9; k++) m[k].resize(n);
+		valid.resize(n);
+	}
+};
+template<typename Math>
+void squareToQuads(QuadBatch<Math>& batch, int s0, int s1);
+template<> void squareToQuads<DoubleMath>(QuadBatch<DoubleMath>& batch, int s0, int s1);
+template<> void squareToQuads<FixedMath>(QuadBatch<FixedMath>& batch, int s0, int s1);
+
+// orders the corners of a quad as top-left, top-right, bottom-right,
+// bottom-left. returns false when a quadrant has no corner.
+bool orderContour(const std::vector<cv::Point>& contour, cv::Point result[4]);
+
+// corners of a marker in template order (top-left of the template first)
+// from its corners in image order, for the rotation and side it was
+// decoded with
+template<typename P>
+void templateCorners(const P corners[4], int rotation, int side, P result[4]) {
+	for (int k = 0; k < 4; k++) {
+		result[k] = corners[((side ? k ^ 1 : k) + rotation) % 4];
+	}
+}
+
+// fused front end of the detector: BGR -> gray -> threshold(64) -> boundary
+// map in a single pass. bin gets exactly the values of
+// threshold(cvtColor(frame), 64); edges marks the bright pixels that have a
+// dark 4-neighbour. vectorized selects the SIMD kernels: OpenCV's 128-bit
+// universal intrinsics (SSE2 on x86, NEON on ARM), compiled in when
+// CV_SIMD128 is set. there is one kernel per build, no per-ISA dispatch.
+void binarizeAndEdges(const cv::Mat& frame, cv::Mat& bin, cv::Mat& edges, bool vectorized);
+// true when the 128-bit kernels are compiled in and useOptimized() is on
+bool fusedKernelVectorized();
+
+// adaptive front end on a grayscale image: bright pixels are the ones above
+// (1 - contrast) times the mean of the (2 radius + 1)^2 window around them
+// (clipped at the image border), less margin gray levels; edges as in
+// binarizeAndEdges. the window sums are updated row by row, so the cost
+// does not depend on radius. vectorized selects the SIMD kernels for the
+// sums, the thresholds and the edges, with the same output as the scalar
+// ones. columnSums is scratch kept between calls.
+void adaptiveBinarizeAndEdges(const cv::Mat& gray, cv::Mat& bin, cv::Mat& edges, int radius, float contrast, int margin,
+	std::vector<float>& columnSums, bool vectorized);
+
+// candidate contours of FRONTEND_MSER: the convex hulls of the maximally
+// stable extremal regions of a grayscale image (both polarities). the MSER
+// component tree visits every threshold level incrementally, so one pass
+// replaces a sweep of global thresholds. regions whose bounding box has at
+// most minArea pixels are dropped; offset is added to every point.
+// returns the number of hulls, written to hulls[0, count): the vectors
+// past count are kept with their capacity for the next call.
+struct RegionHullScratch {
+	cv::Ptr<cv::MSER> mser; // created on the first call
+	std::vector<std::vector<cv::Point> > regions;
+	std::vector<cv::Rect> boxes;
+};
+int regionHulls(const cv::Mat& gray, double minArea, std::vector<std::vector<cv::Point> >& hulls, RegionHullScratch& scratch,
+	cv::Point offset = cv::Point());
+
+// fixed-size work-stealing thread pool for index loops. parallelFor splits
+// [0, n) into one contiguous range per thread; each thread takes indices
+// from the front of its own range and, when it runs dry, steals the back
+// half of the largest range left. the calling thread works as thread 0.
+class WorkStealingPool {
+public:
+	// threads <= 0 uses one thread per core
+	explicit WorkStealingPool(int threads = 0);
+	~WorkStealingPool();
+
+	int size() const { return threadCount; }
+
+	// calls body(index, thread) for every index in [0, n) and waits for all
+	// of them. thread is in [0, size()) and can select per-thread scratch.
+	template<typename Body>
+	void parallelFor(int n, Body& body) {
+		if (threadCount == 1 || n <= 1) {
+			for (int i = 0; i < n; i++) body(i, 0);
+			return;
+		}
+		dispatch(n, [](void* context, int index, int thread) { (*(Body*)context)(index, thread); }, &body);
+	}
+
+private:
+	struct WorkRange {
+		std::mutex lock;
+		int begin = 0, end = 0;
+	};
+
+	void dispatch(int n, void (*function)(void*, int, int), void* context);
+	void run(int thread);
+	bool next(int thread, int& index);
+	void workerLoop(int thread);
+
+	int threadCount;
+	std::unique_ptr<WorkRange[]> ranges;
+	std::vector<std::thread> workers;
+
+	std::mutex jobLock;
+	std::condition_variable jobReady, jobDone;
+	int generation, active;
+	bool stopping;
+	void (*job)(void*, int, int);
+	void* jobContext;
+};
+
+// pipeline stages timed by Profiler and the counters it keeps per frame
+enum TraceStage {
+	STAGE_DETECT,     // whole detect() / detectRegion() call
+	STAGE_BINARIZE,   // fused front end, or cvtColor + threshold
+	STAGE_EDGES,      // Canny (FRONTEND_CANNY)
+	STAGE_CONTOURS,   // findContours
+	STAGE_FILTER,     // hierarchy filter, approxPolyDP and the cosine test
+	STAGE_DECODE,     // every candidate: homography, sampling, matching
+	STAGE_HOMOGRAPHY, // one candidate
+	STAGE_SAMPLE,     // one candidate: cell sampling or warpPerspective
+	STAGE_MATCH,      // dictionary lookup or stacked decoder
+	STAGE_REFINE,     // MarkerPoseEstimator
+	STAGE_OVERLAY,    // compositing of the sample applications
+	STAGE_COUNT
+};
+
+enum TraceCounter {
+	COUNTER_CONTOURS,
+	COUNTER_HOLES,      // rejected by the filters of CandidateStats
+	COUNTER_OPEN,
+	COUNTER_SMALL,
+	COUNTER_POLYGON,
+	COUNTER_ANGLE,
+	COUNTER_CANDIDATES,
+	COUNTER_DECODES,    // decodes attempted
+	COUNTER_DECODED,    // ... with a border and at least one template
+	COUNTER_CACHED,     // decodes reused by temporal voting
+	COUNTER_MARKERS,
+	COUNTER_COUNT
+};
+
+// milliseconds per frame over the rolling window
+struct StageStats {
+	double mean, p95, max;
+};
+
+struct ProfileSnapshot {
+	int frames; // in the window
+	StageStats stages[STAGE_COUNT];
+	double counters[COUNTER_COUNT]; // mean per frame
+};
+
+// per-stage timers and per-frame counters of the detector. a stage adds
+// its time to the current frame (from any thread) and endFrame() moves the
+// frame into a rolling window of the last frames, which snapshot()
+// summarizes. between startTrace() and stopTrace() every timed scope is
+// also recorded, in a buffer per thread, and writeTrace() exports them
+// with the counters as Chrome trace events (chrome://tracing, Perfetto).
+//
+// the hooks in the library are the TM_SCOPE and TM_COUNT macros, which
+// are empty unless TM_TRACE is defined (TRANSPARENT_TRACE in CMake); a
+// profiler is attached with setProfiler() and a null one costs a test.
+class Profiler {
+public:
+	explicit Profiler(int window = 120);
+	~Profiler();
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	static const char* stageName(TraceStage stage);
+	static const char* counterName(TraceCounter counter);
+	// steady clock in nanoseconds
+	static int64_t now();
+
+	void add(TraceStage stage, int64_t begin, int64_t end);
+	void count(TraceCounter counter, int n) { counterTotals[counter] += n; }
+	// closes the current frame; call once per frame, after its last stage
+	void endFrame();
+
+	ProfileSnapshot snapshot() const;
+	// one line per stage and counter
+	void printSnapshot(FILE* out) const;
+
+	// records at most maxEvents events from now on
+	void startTrace(size_t maxEvents = 1 << 20);
+	void stopTrace() { tracing = false; }
+	// call when no stage is running (after stopTrace or between frames)
+	bool writeTrace(const std::string& file) const;
+
+private:
+	// counter events have stage -1 - counter and their value in end
+	struct TraceEvent {
+		int64_t begin, end;
+		int stage;
+	};
+	struct ThreadBuffer {
+		std::thread::id owner;
+		int thread;
+		std::vector<TraceEvent> events;
+	};
+
+	ThreadBuffer* threadBuffer();
+	void record(int stage, int64_t begin, int64_t end);
+
+	const uint64_t serial;
+	int window, frames;
+	std::atomic<int64_t> stageTotals[STAGE_COUNT];
+	std::atomic<int> counterTotals[COUNTER_COUNT];
+	std::vector<float> stageHistory; // [window][STAGE_COUNT]
+	std::vector<int> counterHistory; // [window][COUNTER_COUNT]
+
+	mutable std::mutex lock;
+	std::vector<std::unique_ptr<ThreadBuffer> > buffers;
+	std::atomic<bool> tracing;
+	std::atomic<size_t> recorded;
+	size_t maxEvents;
+	int64_t origin;
+};
+
+// times the enclosing scope into a profiler (nothing when it is null)
+class ScopedTimer {
+public:
+	ScopedTimer(Profiler* profiler, TraceStage stage) : profiler(profiler), stage(stage), begin(profiler ? Profiler::now() : 0) {}
+	~ScopedTimer() {
+		if (profiler) profiler->add(stage, begin, Profiler::now());
+	}
+
+private:
+	Profiler* profiler;
+	TraceStage stage;
+	int64_t begin;
+};
+
+#define TM_CONCAT_(a, b) a##b
+#define TM_CONCAT(a, b) TM_CONCAT_(a, b)
+
+#ifdef TM_TRACE
+#define TM_SCOPE(profiler, stage) transparent::ScopedTimer TM_CONCAT(traceScope, __LINE__)(profiler, transparent::stage)
+#define TM_COUNT(profiler, counter, n) do { if (profiler) (profiler)->count(transparent::counter, n); } while (0)
+#else
+#define TM_SCOPE(profiler, stage) ((void)0)
+#define TM_COUNT(profiler, counter, n) ((void)0)
+#endif
+
+#ifdef TM_COUNT_ALLOCATIONS
+// depth of the OpenCV calls with internal work buffers (findContours, Canny,
+// approxPolyDP, convexHull, MSER, pyrDown, warpPerspective) the calling thread is in:
+// test-allocations books their allocations to OpenCV, anything else
+// allocating inside a warm detect() fails it
+extern thread_local int openCvCallDepth;
+struct OpenCvCall {
+	OpenCvCall() { openCvCallDepth++; }
+	~OpenCvCall() { openCvCallDepth--; }
+};
+#define TM_OPENCV_CALL() transparent::OpenCvCall TM_CONCAT(openCvCall, __LINE__)
+#else
+#define TM_OPENCV_CALL() ((void)0)
+#endif
+
+struct MarkerQuad {
+	cv::Point corners[4];
+};
+
+// one decoded marker. corners are in image order (orderContour; see
+// templateCorners), stacked is the number of templates decoded on the same
+// quad, confidence the one of MarkerMatch.
+struct DetectedMarker {
+	cv::Point corners[4];
+	int id;
+	int rotation;
+	int side;
+	int stacked;
+	float confidence;
+};
+
+// contours seen by the last findCandidates() and where they were dropped
+struct CandidateStats {
+	int contours = 0;
+	int holes = 0;        // inner side of an edge loop, the outer side is tested
+	int open = 0;         // edge curve without an inside: cannot be a marker border
+	int small = 0;        // point count, bounding box or perimeter too small
+	int approximated = 0; // reached approxPolyDP
+	int polygon = 0;      // not a convex quad above the minimum area
+	int angle = 0;        // corner angles too far from 90 degrees
+	int candidates = 0;
+};
+
+// what temporal voting did in the last decodeCandidates()
+struct VotingStats {
+	int tracks = 0; // quads followed
+	int cached = 0; // decodes reused: same position, same appearance
+	int held = 0;   // quads reported with their previous templates against the current decode
+};
+
+// FRONTEND_FUSED builds the binary and edge images with binarizeAndEdges,
+// FRONTEND_CANNY with cvtColor + threshold + Canny (reference mode),
+// FRONTEND_ADAPTIVE with adaptiveBinarizeAndEdges (dim or uneven light).
+// FRONTEND_MSER thresholds like FRONTEND_CANNY for the decoders but takes
+// its contours from regionHulls instead of the edge image, which stays
+// empty. the decoders read the same binary image.
+enum FrontEnd { FRONTEND_FUSED, FRONTEND_CANNY, FRONTEND_ADAPTIVE, FRONTEND_MSER };
+
+// DECODE_SAMPLE reads only the 11x11 cell centers from the source image,
+// DECODE_WARP warps the whole 242x242 marker first (reference mode)
+enum DecodeMode { DECODE_SAMPLE, DECODE_WARP };
+
+// per-frame marker detector. it owns every scratch buffer of the pipeline,
+// so once the buffers have grown to the frame size and candidate count a
+// call to detect() does not allocate on the heap. one detector must not be
+// used by two threads at once; the dictionary must outlive it.
+class MarkerDetector {
+public:
+	// stacked = false decodes the first matching template with a fixed
+	// threshold (boy/girl sample), stacked = true decodes the stack of
+	// templates with StackedDecoder from the gray levels (color sample)
+	explicit MarkerDetector(const MarkerDictionary& dictionary, bool stacked = false);
+
+	// markers is cleared and filled in contour order; its capacity is reused
+	void detect(const cv::Mat& frame, std::vector<DetectedMarker>& markers);
+
+	// detect() restricted to roi of the frame, corners in frame coordinates.
+	// binary() and edges() are only updated inside roi.
+	void detectRegion(const cv::Mat& frame, const cv::Rect& roi, std::vector<DetectedMarker>& markers);
+
+	// the three stages of detect()
+	void preprocess(const cv::Mat& frame);
+	void preprocess(const cv::Mat& frame, const cv::Rect& roi);
+	void findCandidates() { findCandidates<DetectorMath>(); }
+	void decodeCandidates(std::vector<DetectedMarker>& markers) { decodeCandidates<DetectorMath>(markers); }
+
+	// the last two with the arithmetic of Math; both are built, so the
+	// fixed-point path can be checked against the reference in one binary.
+	// Math only changes the batched decoder: the per-candidate and
+	// DECODE_WARP reference modes stay in double.
+	template<typename Math> void findCandidates();
+	template<typename Math> void decodeCandidates(std::vector<DetectedMarker>& markers);
+
+	// number of threads decoding candidates (<= 0: one per core). the output
+	// order is the contour order whatever the thread count.
+	void setThreads(int threads);
+
+	// decodes one quad of a grayscale image. matches is cleared and filled
+	// with the matching templates; returns false if the marker border is missing
+	bool decode(const cv::Mat& image, const cv::Point corners[4], std::vector<MarkerMatch>& matches);
+
+	// reads the 0/1 cell matrix of one quad with the current decode mode;
+	// returns false if the homography cannot be computed
+	bool readMarkerMatrix(const cv::Mat& image, const cv::Point corners[4], int markerMatrix[11][11]) {
+		return readMarkerMatrix(image, corners, markerMatrix, contents[0]);
+	}
+
+	// smallest quad area kept as a candidate, in pixels of the processed image
+	void setMinArea(double area) { minArea = area; }
+
+	// reject contours from the RETR_CCOMP hierarchy and cheap bounds before
+	// approxPolyDP (default); false tests every contour (reference)
+	void setHierarchyFilter(bool enabled) { hierarchyFilter = enabled; }
+	const CandidateStats& candidateStats() const { return stats; }
+
+	void setFrontEnd(FrontEnd mode) { frontEnd = mode; }
+	FrontEnd getFrontEnd() const { return frontEnd; }
+
+	// upper Canny threshold of FRONTEND_CANNY
+	void setCannyThreshold(int threshold) { cannyThreshold = threshold; }
+
+	// window radius (0, default: a sixteenth of the frame height, so the
+	// window spans about an eighth of it) and contrast (default 0.15) of
+	// FRONTEND_ADAPTIVE
+	void setAdaptiveThreshold(int radius, float contrast) {
+		adaptiveRadius = radius;
+		adaptiveContrast = contrast;
+	}
+
+	void setDecodeMode(DecodeMode mode) { decodeMode = mode; }
+	DecodeMode getDecodeMode() const { return decodeMode; }
+
+	// DECODE_SAMPLE only: true (default) maps every candidate of the frame
+	// with squareToQuads and samples them into one contiguous array, false
+	// solves and samples each candidate on its own (reference mode)
+	void setBatchDecoding(bool enabled) { batchDecoding = enabled; }
+	bool getBatchDecoding() const { return batchDecoding; }
+
+	// stacked detectors only: true (default) decodes with StackedDecoder,
+	// false keeps every template compatible with an Otsu threshold of the
+	// marker (reference mode)
+	void setSoftStacking(bool enabled) { softStacking = enabled; }
+	bool getSoftStacking() const { return softStacking; }
+	StackedDecoder& stackedDecoder() { return stackDecoder; }
+
+	// darkness of the 5x5 inner cells of one quad of a grayscale image, for
+	// StackedDecoder, from the white border and the dark surround of the
+	// marker. returns false if the homography cannot be computed, the
+	// contrast is too low or the border is missing.
+	bool readCellDarkness(const cv::Mat& image, const cv::Point corners[4], float darkness[MarkerDictionary::CELLS]) {
+		return readCellDarkness(image, corners, darkness, contents[0]);
+	}
+
+	// temporal voting over the last votes decodes of each quad (0, default:
+	// off; at most MAX_VOTES). quads are followed from call to call by their
+	// position, and the templates (ids and sides) reported for one only
+	// change when another result wins a strict majority of the votes
+	// recorded for it (after votes / 2 + 1 calls at most), so a single
+	// misdecoded frame does not flip the marker. a quad that has not moved
+	// and whose bright pixels have not changed reuses its last decode, for
+	// up to votes calls. a quad not seen for votes calls is forgotten; every
+	// detectRegion() is a call.
+	void setTemporalVoting(int votes);
+	int getTemporalVoting() const { return votes; }
+	const VotingStats& votingStats() const { return voting; }
+	static const int MAX_VOTES = 16;
+
+	// takes the front end, contour filter and decode settings of other
+	// (stacked and soft stacking included; not the threads, the profiler,
+	// temporal voting or the buffers). an explicit adaptive window radius
+	// is divided by scale, for a detector that runs on a downscaled frame.
+	void copySettings(const MarkerDetector& other, int scale = 1);
+
+	// times the stages and counts candidates into profiler (null: off)
+	void setProfiler(Profiler* profiler) { this->profiler = profiler; }
+	Profiler* getProfiler() const { return profiler; }
+
+	const MarkerDictionary& getDictionary() const { return dictionary; }
+	const cv::Mat& binary() const { return bin; }
+	const cv::Mat& edges() const { return edgeMap; }
+	const std::vector<MarkerQuad>& quads() const { return candidates; }
+
+private:
+	// bright cells (or cell darkness) of a decoded candidate, valid = border found
+	// history is the quad of temporal voting it was paired with (or -1),
+	// cached = it reuses the decode of that quad
+	struct CandidateCode {
+		uint32_t bright;
+		float darkness[MarkerDictionary::CELLS];
+		bool valid;
+		int history;
+		bool cached;
+	};
+
+	// a quad followed by temporal voting: where it is and where and how it
+	// looked at its last decode, that decode, the results of the last
+	// decodes (as matchKey) and what is reported for it
+	struct QuadHistory {
+		cv::Point corners[4], decodedCorners[4];
+		uint16_t appearance[16];
+		int appearanceSamples;
+		int lastSeen, sinceDecode;
+		bool claimed;
+		std::vector<MarkerMatch> decoded, reported;
+		uint64_t decodedKey, reportedKey;
+		uint64_t keys[MAX_VOTES];
+		int voteCount, voteHead;
+	};
+
+	bool readMarkerMatrix(const cv::Mat& image, const cv::Point corners[4], int markerMatrix[11][11], cv::Mat& content);
+	bool readCellDarkness(const cv::Mat& image, const cv::Point corners[4], float darkness[MarkerDictionary::CELLS], cv::Mat& content);
+	bool softDecoding() const { return stacked && softStacking; }
+	template<typename Math> void decodeBatch();
+	template<typename Math> QuadBatch<Math>& quadBatch();
+	void matchHistory();
+	const std::vector<MarkerMatch>& vote(int candidate, const std::vector<MarkerMatch>& current);
+	bool decodeCode(const cv::Mat& image, const cv::Point corners[4], uint32_t& bright, cv::Mat& content);
+	void retrieveMatches(uint32_t bright, std::vector<MarkerMatch>& matches);
+
+	const MarkerDictionary& dictionary;
+	bool stacked;
+	bool softStacking;
+	StackedDecoder stackDecoder;
+	FrontEnd frontEnd;
+	DecodeMode decodeMode;
+	bool batchDecoding;
+	bool vectorized;
+	bool hierarchyFilter;
+	int cannyThreshold;
+	int adaptiveRadius;
+	float adaptiveContrast;
+	double minArea;
+	CandidateStats stats;
+	cv::Mat gray, bin, edgeMap;
+	cv::Mat paddedBin, paddedEdges; // FRONTEND_ADAPTIVE on a roi
+	std::vector<float> columnSums;
+	std::vector<cv::Mat> contents;
+	std::vector<std::vector<cv::Point> > contours;
+	std::vector<cv::Vec4i> hierarchy;
+	int contourCount; // contours[0, contourCount) are this frame's
+	RegionHullScratch regionScratch;
+	std::vector<cv::Point> approx;
+	std::vector<MarkerQuad> candidates;
+	std::vector<CandidateCode> codes;
+	QuadBatch<DoubleMath> batch;
+	QuadBatch<FixedMath> fixedBatch;
+	std::vector<unsigned char> cellSamples; // [candidate][cell][patch sample]
+	std::vector<MarkerMatch> matches;
+	int votes, calls;
+	VotingStats voting;
+	std::vector<QuadHistory> history;
+	int historyCount; // history[0, historyCount) are followed, the rest are kept for their buffers
+	cv::Point2f objectPoints[4];
+	std::unique_ptr<WorkStealingPool> pool;
+	Profiler* profiler;
+};
+
+// refined corners of one decoded marker, in template order. homography
+// maps the unit square (0,0)-(1,1) onto corners (zero for a degenerate quad); rvec/tvec place
+// the marker in the camera frame and are only set (hasPose) when camera
+// intrinsics are loaded.
+struct MarkerPose {
+	int id;
+	cv::Point2f corners[4];
+	cv::Matx33d homography;
+	cv::Vec3d rvec, tvec;
+	bool hasPose;
+};
+
+// refinement stage after detection. the integer corners of approxPolyDP
+// move by a pixel from frame to frame, so each one is refined with
+// cornerSubPix on the gray levels around it; the homography comes from the
+// direct four-point solver and, with camera intrinsics, solvePnP gives the
+// 6-DoF pose. the pose of the same id in the previous frame, the nearest
+// one within a few pixels, seeds the iterative solver, which keeps it from
+// flipping between the two planar solutions; other markers start with
+// IPPE_SQUARE.
+class MarkerPoseEstimator {
+public:
+	MarkerPoseEstimator();
+
+	// camera_matrix and distortion_coefficients as written by the OpenCV
+	// calibration sample, for the size of the frames given to estimate()
+	bool loadIntrinsics(const std::string& file);
+	bool hasIntrinsics() const { return !cameraMatrix.empty(); }
+
+	// side of the marker border square, in the units of tvec
+	void setMarkerSize(double size);
+
+	// false keeps the integer corners (reference mode)
+	void setSubpixel(bool enabled) { subpixel = enabled; }
+
+	// poses[i] is the refinement of markers[i], corners in template order
+	// so the pose follows the marker orientation. stacked markers share
+	// one refinement.
+	void estimate(const cv::Mat& frame, const std::vector<DetectedMarker>& markers, std::vector<MarkerPose>& poses);
+
+	// forgets the poses of the previous frame
+	void reset() { previous.clear(); }
+
+	void setProfiler(Profiler* profiler) { this->profiler = profiler; }
+
+private:
+	void refineCorners(const cv::Mat& frame, const cv::Point corners[4], cv::Point2f refined[4]);
+
+	cv::Mat cameraMatrix, distortion;
+	double markerSize;
+	bool subpixel;
+	cv::Mat patch;
+	std::vector<cv::Point2f> corner;
+	std::vector<cv::Point3f> objectPoints;
+	std::vector<cv::Point2f> imagePoints;
+	std::vector<MarkerPose> previous;
+	Profiler* profiler;
+};
+
+// follows decoded markers from frame to frame so the full-frame detector
+// only runs every detectionInterval frames or after a marker is lost. each
+// track predicts its quad with a constant-velocity model on the corners and
+// is confirmed by running the quad search and decode on a small ROI around
+// the prediction. new markers show up at the next full detection.
+class MarkerTracker {
+public:
+	MarkerTracker(MarkerDetector& detector, int detectionInterval = 10);
+
+	// same output as MarkerDetector::detect
+	void track(const cv::Mat& frame, std::vector<DetectedMarker>& markers);
+
+	int fullDetections() const { return detections; }
+	int trackedFrames() const { return tracked; }
+
+private:
+	// one quad; all markers decoded on it (stacked) are kept together
+	struct Track {
+		cv::Point2f corners[4];
+		cv::Point2f velocity[4];
+		int id;
+	};
+
+	void startTracks(const std::vector<DetectedMarker>& markers);
+
+	MarkerDetector& detector;
+	int detectionInterval;
+	int sinceDetection;
+	bool lost;
+	int detections, tracked;
+	std::vector<Track> tracks, nextTracks;
+	std::vector<DetectedMarker> found;
+};
+
+// coarse-to-fine detection for high resolution frames. candidate quads are
+// searched on a pyrDown level of the frame (with a smaller minimum area, so
+// small markers survive the downscale), then each one is refined and decoded
+// by the full resolution detector on a ROI around the scaled-up quad. the
+// coarse search runs with the settings of the full resolution detector at
+// each call, so both find the same kind of quads.
+class PyramidDetector {
+public:
+	// levels: number of pyrDown steps for the coarse search
+	PyramidDetector(MarkerDetector& detector, int levels = 2, double coarseMinArea = 100);
+
+	void detect(const cv::Mat& frame, std::vector<DetectedMarker>& markers);
+
+	// time of the last detect(): pyramid + coarse search, full-res refinement
+	double coarseMilliseconds() const { return coarseMs; }
+	double refineMilliseconds() const { return refineMs; }
+	int coarseCandidates() const { return (int)coarse.quads().size(); }
+
+private:
+	MarkerDetector& detector;
+	MarkerDetector coarse;
+	int levels;
+	double coarseMinArea;
+	std::vector<cv::Mat> pyramid;
+	std::vector<DetectedMarker> found;
+	double coarseMs, refineMs;
+};
+
+// draws textures onto quads of a frame. each draw warps only the bounding
+// box of the texture as it lands in the target, so the cost follows the
+// overlay area instead of the frame size. textures are registered once
+// and keep a pyramid (built on first use) so a marker far from the
+// camera samples a level close to its size, which is cheaper and does not
+// alias. pixels outside the texture are left untouched, as with
+// BORDER_TRANSPARENT.
+class OverlayCompositor {
+public:
+	OverlayCompositor();
+
+	// copies image into the cache and returns its handle
+	int addTexture(const cv::Mat& image);
+	const cv::Mat& texture(int handle) const { return textures[handle].levels[0]; }
+
+	// h maps texture pixels to target pixels. returns false when nothing
+	// of the texture lands in target or h is degenerate.
+	bool draw(cv::Mat& target, int handle, const cv::Matx33d& h);
+
+	// false warps the full target from the full resolution texture, as
+	// warpPerspective(texture, target, h, target.size(), INTER_LINEAR,
+	// BORDER_TRANSPARENT) (reference mode)
+	void setRoiOnly(bool enabled) { roiOnly = enabled; }
+	// false always samples the full resolution texture
+	void setMipmaps(bool enabled) { mipmaps = enabled; }
+
+	// target pixels visited by the draws since the last call
+	int64_t takeWarpedPixels() {
+		int64_t pixels = warpedPixels;
+		warpedPixels = 0;
+		return pixels;
+	}
+
+private:
+	struct Texture {
+		std::vector<cv::Mat> levels;
+		bool complete;
+	};
+
+	const cv::Mat& level(Texture& texture, int index);
+
+	std::vector<Texture> textures;
+	bool roiOnly, mipmaps;
+	int64_t warpedPixels;
+};
+
+// one marker of a synthetic scene. corners are the outer corners of the
+// white border in image order, as DetectedMarker reports them; markers of
+// one stack share them.
+struct SceneMarker {
+	cv::Point2f corners[4];
+	int id;
+	int rotation;
+	int side;
+	int stacked;
+};
+
+// what a synthetic scene holds and how it is degraded. sides are the
+// white border square of a marker, in pixels.
+struct SceneOptions {
+	cv::Size size = cv::Size(640, 360);
+	int markers = 4;               // quads placed, fewer when they do not fit
+	int maxStack = 1;              // templates per quad, 1 to maxStack
+	double backProbability = 0.5;  // chance of a quad seen from the back
+	double minSide = 50, maxSide = 120;
+	double maxRotation = 25;       // in-plane, degrees
+	double maxTilt = 0.08;         // corner jitter (perspective), fraction of the side
+	double blur = 0.8;             // gaussian sigma in pixels, 0 = none
+	double noise = 4;              // gaussian sigma in gray levels
+	double minLight = 170, maxLight = 235; // background level, before the gradient
+	double lightingGradient = 0.3; // brightness change across the frame
+	int clutter = 20;              // rectangles, circles and lines outside the markers
+};
+
+// renders the templates of a dictionary into synthetic frames with known
+// ground truth, for recall and accuracy measurements without recorded
+// clips. markers are drawn from their codes as absorbing ink over the
+// background (a stacked template darkens what is already dark), on a
+// lit background with clutter, then blurred and given sensor noise.
+// in-plane rotations stay below 45 degrees so the image order of the
+// corners is the rendering order, and the rotation and side of a marker
+// are the ones of its code.
+class SceneGenerator {
+public:
+	SceneGenerator(const MarkerDictionary& dictionary, uint64_t seed = 1);
+
+	// frame gets a CV_8UC3 scene, truth one entry per template in quad order
+	void generate(const SceneOptions& options, cv::Mat& frame, std::vector<SceneMarker>& truth);
+
+private:
+	void drawMarker(uint32_t code, const cv::Matx33d& cellToImage, float absorption);
+
+	const MarkerDictionary& dictionary;
+	cv::RNG rng;
+	cv::Mat light, ink, warped, color, noise;
+	std::vector<cv::Rect> boxes;
+};
+
+}
+
+#endif